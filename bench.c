@@ -0,0 +1,684 @@
+/*
+ * kernelflut-bench drives the pixelflut pipeline with a synthetic capture
+ * source, so encoder and transport changes can be compared without an EVDI
+ * device. Unless a HOST is given, pixels are sent to a loopback sink running
+ * in a thread of this process which reads and discards everything, over TCP
+ * or, with -u, UDP. A HOST of unix:PATH without a PORT puts the sink on a unix
+ * socket, and with shm:PATH a stand-in server consumes the shared canvas
+ * instead. With -V, the sink keeps a canvas instead, answers reads, and plays
+ * a rival client that keeps painting over it. With relay: and no PORT, a
+ * stand-in for kernelflut-relay in this process forwards the uplink to the
+ * sink; the results only count the uplink.
+ */
+
+#include <linux/futex.h>	/* FUTEX_WAIT */
+#include <netinet/in.h>	/* sockaddr_in */
+#include <pthread.h>	/* pthread_create */
+#include <signal.h>	/* sig_atomic_t */
+#include <stdbool.h>	/* bool, true, false */
+#include <stdio.h>	/* perror, printf, sprintf */
+#include <stdlib.h>	/* atoi, calloc, rand, strtod */
+#include <fcntl.h>	/* open */
+#include <string.h>	/* memcpy, strncmp */
+#include <sys/epoll.h>	/* epoll */
+#include <sys/mman.h>	/* mmap */
+#include <sys/socket.h>	/* socket, bind, listen, accept */
+#include <sys/syscall.h>	/* SYS_futex */
+#include <sys/un.h>	/* sockaddr_un */
+#include <time.h>	/* nanosleep */
+#include <unistd.h>	/* close, getopt, read, syscall, unlink */
+
+#include "error.h"	/* ERR_* */
+#include "evdi.h"	/* evdi_rect */
+#include "metrics.h"	/* metrics_start, metrics_stop */
+#include "options.h"	/* options, options_* */
+#include "pixelflut.h"	/* pf_* */
+#include "relay.h"	/* relay_* */
+#include "shard.h"	/* shard_* */
+#include "stats.h"	/* stats_* */
+#include "trace.h"	/* trace_* */
+
+#define WIDTH 800
+#define HEIGHT 600
+#define WINDOW_W 200
+#define WINDOW_H 150
+
+#define DEFAULT_DURATION	5	/* seconds */
+#define MAX_DURATION		(365.0 * 24 * 60 * 60)	/* so it fits in nanoseconds */
+
+#define SINK_EVENTS 64
+#define SINK_BUF_LEN 65536
+#define SINK_FDS 1024		/* connections the canvas sink keeps lines of */
+#define SINK_LINE 64
+#define SINK_RCVBUF (4 * 1024 * 1024)	/* bytes, for datagrams */
+#define CONSUMER_TIMEOUT 100	/* ms the shared canvas consumer sleeps at most */
+#define SHARD_TIMEOUT 100	/* ms the main thread waits for the shards at most */
+
+/* the rival client of the canvas sink */
+#define RIVAL_SIZE 48		/* px, side of the square it paints */
+#define RIVAL_INTERVAL 100	/* ms between squares */
+
+bool pt_active = true;
+volatile sig_atomic_t doomed;
+
+static bool sink_udp;
+
+/* the canvas of the sink, upscaled, and the partial command last read on each connection */
+static uint32_t *sink_canvas;
+static int sink_w = WIDTH, sink_h = HEIGHT;
+static struct {
+	int len;
+	char line[SINK_LINE];
+} *sink_lines;
+
+/*
+ * sink_command carries out a command for the canvas sink, appending the reply
+ * to a read to out. Returns the length of the reply.
+ */
+static int sink_command(const char *line, char *out)
+{
+	int x, y;
+	unsigned int color;
+	int n = sscanf(line, "PX %d %d %x", &x, &y, &color);
+	if (n < 2 || x < 0 || x >= sink_w || y < 0 || y >= sink_h)
+		return 0;
+
+	if (n == 3) {
+		sink_canvas[y * sink_w + x] = color;
+		return 0;
+	}
+	return sprintf(out, "PX %d %d %06x\n", x, y, sink_canvas[y * sink_w + x]);
+}
+
+/*
+ * sink_consume feeds what connection fd sent to the canvas sink, and answers
+ * reads, to from if it's a datagram
+ */
+static void sink_consume(int fd, const char *buf, int len, const struct sockaddr *from, socklen_t fromlen)
+{
+	static char out[SINK_BUF_LEN / 6 * SINK_LINE];
+	int out_len = 0;
+
+	for (int k = 0; k < len; k++) {
+		if (buf[k] != '\n') {
+			if (sink_lines[fd].len < SINK_LINE - 1)
+				sink_lines[fd].line[sink_lines[fd].len++] = buf[k];
+			continue;
+		}
+		sink_lines[fd].line[sink_lines[fd].len] = '\0';
+		sink_lines[fd].len = 0;
+		out_len += sink_command(sink_lines[fd].line, out + out_len);
+	}
+
+	if (out_len && sendto(fd, out, out_len, 0, from, fromlen) != out_len)
+		perror("sink write");
+}
+
+/* rival paints a square over a random spot of the canvas sink */
+static void rival(void)
+{
+	const int x1 = rand() % (sink_w - RIVAL_SIZE), y1 = rand() % (sink_h - RIVAL_SIZE);
+	for (int y = y1; y < y1 + RIVAL_SIZE; y++)
+		for (int x = x1; x < x1 + RIVAL_SIZE; x++)
+			sink_canvas[y * sink_w + x] = 0;
+}
+
+/*
+ * sink_run accepts connections on listen_fd and discards whatever they send,
+ * or plays pixelflut server with sink_canvas
+ */
+static void *sink_run(void *arg)
+{
+	int listen_fd = *(int *) arg;
+	static char buf[SINK_BUF_LEN];
+	const int timeout = sink_canvas ? RIVAL_INTERVAL : -1;
+	uint64_t rival_at = 0;
+
+	int epoll_fd = epoll_create1(0);
+	if (epoll_fd == -1) {
+		perror("sink epoll_create1");
+		return NULL;
+	}
+
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = listen_fd };
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+	for (;;) {
+		struct epoll_event events[SINK_EVENTS];
+		int n = epoll_wait(epoll_fd, events, SINK_EVENTS, timeout);
+		if (sink_canvas && stats_now() >= rival_at) {
+			rival();
+			rival_at = stats_now() + (uint64_t) RIVAL_INTERVAL * 1000 * 1000;
+		}
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == listen_fd && sink_udp) {
+				struct sockaddr_storage from;
+				socklen_t fromlen = sizeof(from);
+				int len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen);
+				if (len > 0 && sink_canvas)
+					sink_consume(fd, buf, len, (struct sockaddr *) &from, fromlen);
+				continue;
+			}
+			if (fd == listen_fd) {
+				int conn = accept(listen_fd, NULL, NULL);
+				if (conn == -1)
+					continue;
+				if (sink_canvas && conn >= SINK_FDS) {
+					close(conn);
+					continue;
+				}
+				if (sink_canvas)
+					sink_lines[conn].len = 0;
+				struct epoll_event ev = { .events = EPOLLIN, .data.fd = conn };
+				epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn, &ev);
+				continue;
+			}
+
+			int len = read(fd, buf, sizeof(buf));
+			if (len <= 0) {
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+				close(fd);
+			} else if (sink_canvas) {
+				sink_consume(fd, buf, len, NULL, 0);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * sink_start listens on an ephemeral loopback port and returns it, or on a
+ * unix socket at path and returns 0, or returns -1. If canvas, the sink keeps
+ * one and answers reads. If udp, it takes datagrams.
+ */
+static int sink_start(const char *path, bool canvas, bool udp)
+{
+	static int listen_fd;
+	static pthread_t thread;
+
+	if (canvas) {
+		sink_canvas = calloc(sink_w * sink_h, sizeof(*sink_canvas));
+		sink_lines = calloc(SINK_FDS, sizeof(*sink_lines));
+		if (sink_canvas == NULL || sink_lines == NULL) {
+			perror("couldn't allocate sink canvas");
+			return -1;
+		}
+	}
+
+	sink_udp = udp;
+	listen_fd = socket(path ? AF_UNIX : AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+	if (listen_fd == -1) {
+		perror("sink socket");
+		return -1;
+	}
+
+	/* the default receive buffer holds only a few datagrams of a burst */
+	int rcvbuf = SINK_RCVBUF;
+	if (udp)
+		setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	struct sockaddr_un local = { .sun_family = AF_UNIX };
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t addrlen = sizeof(addr);
+	int err;
+	if (path) {
+		strncpy(local.sun_path, path, sizeof(local.sun_path) - 1);
+		unlink(path);
+		err = bind(listen_fd, (struct sockaddr *) &local, sizeof(local));
+	} else {
+		err = bind(listen_fd, (struct sockaddr *) &addr, addrlen)
+			|| getsockname(listen_fd, (struct sockaddr *) &addr, &addrlen);
+	}
+	if (err || (!udp && listen(listen_fd, SOMAXCONN))) {
+		perror("sink bind");
+		close(listen_fd);
+		return -1;
+	}
+
+	if (pthread_create(&thread, NULL, sink_run, &listen_fd)) {
+		perror("sink pthread_create");
+		close(listen_fd);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return path ? 0 : ntohs(addr.sin_port);
+}
+
+/*
+ * consumer_run stands in for a pixelflut server on this machine sharing
+ * canvas with us: whenever the doorbell rings, it copies the canvas, the way
+ * a server would present it
+ */
+static void *consumer_run(void *arg)
+{
+	struct pf_shm *canvas = arg;
+	const size_t len = (size_t) canvas->width * canvas->height * sizeof(canvas->pixels[0]);
+	uint32_t *frame = malloc(len);
+	if (frame == NULL) {
+		perror("couldn't allocate consumer frame");
+		return NULL;
+	}
+
+	const struct timespec timeout = { 0, CONSUMER_TIMEOUT * 1000 * 1000 };
+	uint32_t seen = 0;
+	for (;;) {
+		__atomic_add_fetch(&canvas->waiters, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &canvas->seq, FUTEX_WAIT, seen, &timeout, NULL, 0);
+		__atomic_sub_fetch(&canvas->waiters, 1, __ATOMIC_SEQ_CST);
+
+		uint32_t seq = __atomic_load_n(&canvas->seq, __ATOMIC_ACQUIRE);
+		if (seq == seen)
+			continue;
+		seen = seq;
+		memcpy(frame, canvas->pixels, len);
+	}
+
+	return NULL;
+}
+
+/* consumer_start maps the shared canvas at path and consumes it in a thread. Returns 0 on success. */
+static int consumer_start(const char *path)
+{
+	static pthread_t thread;
+
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		perror("couldn't open shared canvas");
+		return ERR_IRRECOVERABLE;
+	}
+	const size_t len = sizeof(struct pf_shm) + WIDTH * HEIGHT * sizeof(uint32_t);
+	struct pf_shm *canvas = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (canvas == MAP_FAILED || __atomic_load_n(&canvas->magic, __ATOMIC_ACQUIRE) != PF_SHM_MAGIC) {
+		fprintf(stderr, "no shared canvas at %s\n", path);
+		return ERR_IRRECOVERABLE;
+	}
+
+	if (pthread_create(&thread, NULL, consumer_run, canvas)) {
+		perror("consumer pthread_create");
+		return ERR_IRRECOVERABLE;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/*
+ * render draws the synthetic desktop into rect r of fb: a flat background with
+ * one window whose top-left corner is (wx, wy) and whose contents change every
+ * frame, like a window playing video being dragged around.
+ */
+static void render(uint32_t *fb, struct evdi_rect r, int wx, int wy, int frame)
+{
+	for (int y = r.y1; y < r.y2; y++) {
+		for (int x = r.x1; x < r.x2; x++) {
+			uint32_t color = 0x00ff00ff;
+			if (x >= wx && x < wx + WINDOW_W && y >= wy && y < wy + WINDOW_H)
+				color = ((x - wx + frame) & 0xff) << 16 | ((y - wy) & 0xff) << 8 | (frame & 0xff);
+			fb[y * WIDTH + x] = color;
+		}
+	}
+}
+
+static struct evdi_rect window_rect(int wx, int wy)
+{
+	struct evdi_rect r = { wx, wy, wx + WINDOW_W, wy + WINDOW_H };
+	return r;
+}
+
+/* the stand-in relay, which forwards to the sink */
+static pthread_t relay_thread;
+static int relay_fd = -1;
+static int relay_sink_port;
+static int relay_connections;
+static volatile sig_atomic_t relay_stop;
+
+/*
+ * relay_run stands in for kernelflut-relay on the server's side. Its counters
+ * aren't registered, so they don't mix with those of the uplink.
+ */
+static void *relay_run(void *arg)
+{
+	(void) arg;
+
+	if (options.udp)
+		pf_udp(options.gso);
+	int err = pf_connect(relay_connections, "127.0.0.1", relay_sink_port, options.connect_timeout, false);
+	if (!err && options.verify_rate)
+		pf_verify(options.verify_rate);
+	pf_upscale(options.upscale);
+	if (!err)
+		err = relay_serve(relay_fd, &relay_stop);
+	if (err)
+		fprintf(stderr, "relay stopped with %d\n", err);
+	pf_close();
+	return NULL;
+}
+
+/*
+ * relay_start starts the stand-in relay, with a pool of connections to the
+ * sink at sink_port. Returns the port it takes the uplink on, or -1.
+ */
+static int relay_start(int sink_port, int connections)
+{
+	relay_fd = relay_listen("127.0.0.1:0");
+	if (relay_fd == -1) {
+		perror("relay listen");
+		return -1;
+	}
+
+	relay_sink_port = sink_port;
+	relay_connections = connections;
+	if (pthread_create(&relay_thread, NULL, relay_run, NULL)) {
+		perror("relay pthread_create");
+		close(relay_fd);
+		relay_fd = -1;
+		return -1;
+	}
+	return relay_port(relay_fd);
+}
+
+static int usage(char *progname)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"  %s [options...] [HOST [PORT]]\n"
+		"\n"
+		"Without HOST, pixels are sent to a loopback sink in this process, also for\n"
+		"unix:PATH without PORT. With shm:PATH, the canvas is read by a stand-in server,\n"
+		"and relay: without PORT goes through a stand-in kernelflut-relay to the sink.\n"
+		"\n"
+		"Options:\n"
+		"",
+		progname
+	);
+	options_usage(true);
+	fprintf(stderr,
+		"  -S FILE		drive a wall of servers listed in FILE, each showing a region of the frame\n"
+		"  -M HOST[:PORT]	also show the frame on HOST, at its own pace (can pass multiple times)\n"
+		"  -d SECONDS		benchmark duration (default %d)\n"
+		"  -f FPS		produce frames at this rate instead of as fast as they are sent\n"
+		"  -j FILE		write JSON results to FILE instead of stdout\n"
+		"  -t FILE		write a Chrome trace of every frame and rect to FILE\n"
+		"",
+		DEFAULT_DURATION
+	);
+	return ERR_BADARG;
+}
+
+int main(int argc, char *argv[])
+{
+	double duration = DEFAULT_DURATION;
+	double fps = 0;
+	char *output = NULL;
+	char *trace_path = NULL;
+	char *shards_path = NULL;
+	char *mirrors[SHARD_MAX];
+	int num_mirrors = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, OPTIONS_POOL OPTIONS_FRAMES "d:f:j:M:S:t:h?")) != -1) {
+		int err = options_parse(opt, optarg);
+		if (err > 0)
+			return usage(argv[0]);
+		if (!err)
+			continue;
+
+		switch (opt) {
+		case 'S':
+			shards_path = optarg;
+			break;
+		case 'M':
+			if (num_mirrors == SHARD_MAX)
+				return usage(argv[0]);
+			mirrors[num_mirrors++] = optarg;
+			break;
+		case 'd':
+			/* also false for NaN */
+			duration = strtod(optarg, NULL);
+			if (!(duration > 0 && duration <= MAX_DURATION))
+				return usage(argv[0]);
+			break;
+		case 'f':
+			fps = strtod(optarg, NULL);
+			if (fps <= 0)
+				return usage(argv[0]);
+			break;
+		case 'j':
+			output = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'h':
+		case '?':
+			usage(argv[0]);
+			return 0;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	char *hostname = "127.0.0.1";
+	int port = 0;
+	if (optind < argc)
+		hostname = argv[optind++];
+	if (optind < argc) {
+		port = atoi(argv[optind++]);
+		if (port <= 0)
+			return usage(argv[0]);
+	}
+	if (optind < argc)
+		return usage(argv[0]);
+
+	stats_register();
+
+	if (trace_path) {
+		int err = trace_open(trace_path);
+		if (err)
+			return err;
+	}
+
+	const bool shared = !port && !strncmp(hostname, "shm:", 4);
+	const bool relayed = !port && !strncmp(hostname, "relay:", 6);
+	if (!port && !shared) {
+		sink_w = WIDTH * options.upscale;
+		sink_h = HEIGHT * options.upscale;
+		port = sink_start(strncmp(hostname, "unix:", 5) ? NULL : hostname + 5, options.verify_rate > 0, options.udp);
+		if (port < 0)
+			return ERR_IRRECOVERABLE;
+	}
+	if (relayed) {
+		hostname = "relay:127.0.0.1";
+		port = relay_start(port, options.connections);
+		if (port < 0)
+			return ERR_IRRECOVERABLE;
+	}
+
+	/* shards default to the sink, too */
+	struct shard_config server = {
+		.host = hostname,
+		.port = port,
+		.connections = options.connections,
+		.region = { 0, 0, WIDTH, HEIGHT },
+		.width = WIDTH,
+		.height = HEIGHT,
+		.rate_cap = options.rate_cap,
+	};
+
+	const bool sharded = shards_path || num_mirrors;
+	int err;
+	if (!sharded)
+		err = options_setup(&server);
+	else if (shards_path)
+		err = shard_load(shards_path, &server);
+	else
+		err = shard_add(&server);
+	for (int i = 0; i < num_mirrors && !err; i++)
+		err = shard_mirror(mirrors[i], &server);
+	if (sharded && !err)
+		err = shard_start(options_setup, WIDTH, HEIGHT, options.bgcolor);
+	if (err) {
+		shard_stop();
+		return err;
+	}
+
+	if (options.metrics_addr) {
+		err = metrics_start(options.metrics_addr);
+		if (err)
+			return err;
+	}
+
+	if (shared) {
+		err = consumer_start(hostname + 4);
+		if (err)
+			return err;
+	}
+
+	uint32_t *fb = calloc(WIDTH * HEIGHT, sizeof(uint32_t));
+	if (fb == NULL) {
+		perror("couldn't allocate framebuffer");
+		return ERR_ALLOC;
+	}
+
+	int wx = 0, wy = 0, dx = 7, dy = 3;
+	int frame = 0;
+	bool frame_open = false;
+	const uint64_t start = stats_now();
+	const uint64_t end = start + duration * 1000 * 1000 * 1000;
+	for (uint64_t now = start; now < end; now = stats_now()) {
+		/*
+		 * the display produces frames at fps, or whenever the last one is
+		 * sent. Frames missed while sending or overloaded are skipped,
+		 * the way EVDI merges them.
+		 */
+		const bool pending = sharded ? shard_pending() : pf_pending();
+		const bool overloaded = sharded ? shard_overloaded() : pf_overloaded();
+		int due = frame + 1;
+		if (fps)
+			due = (now - start) * fps / 1e9 + 1;
+		else if (pending)
+			due = frame;
+		if (overloaded)
+			due = frame;
+
+		if (due > frame) {
+			/* capture: the first frame damages everything, later ones the old and new window */
+			uint64_t t = stats_now();
+			struct evdi_rect rects[2];
+			int num_rects;
+			if (!frame) {
+				struct evdi_rect all = { 0, 0, WIDTH, HEIGHT };
+				rects[0] = all;
+				num_rects = 1;
+			} else {
+				STATS_ADD(frames_dropped, due - frame - 1);
+				rects[0] = window_rect(wx, wy);
+				for (int f = frame; f < due; f++) {
+					if (wx + dx < 0 || wx + dx + WINDOW_W > WIDTH)
+						dx = -dx;
+					if (wy + dy < 0 || wy + dy + WINDOW_H > HEIGHT)
+						dy = -dy;
+					wx += dx;
+					wy += dy;
+				}
+				rects[1] = window_rect(wx, wy);
+				num_rects = 2;
+			}
+			frame = due;
+
+			/* the window is being dragged by its middle */
+			const int cursor_x = wx + WINDOW_W / 2;
+			const int cursor_y = wy + WINDOW_H / 2;
+
+			/* the shards count their own frames */
+			if (sharded) {
+				for (int r = 0; r < num_rects; r++)
+					render(fb, rects[r], wx, wy, frame);
+				shard_damage(fb, rects, num_rects, t, cursor_x, cursor_y);
+				continue;
+			}
+
+			pf_cursor(cursor_x, cursor_y);
+
+			uint64_t damaged = 0;
+			for (int r = 0; r < num_rects; r++) {
+				render(fb, rects[r], wx, wy, frame);
+				damaged += (rects[r].x2 - rects[r].x1) * (rects[r].y2 - rects[r].y1);
+				pf_damage(rects[r].x1, rects[r].x2, rects[r].y1, rects[r].y2);
+			}
+			stats_stage_add(STAGE_CAPTURE, stats_now() - t, damaged);
+			trace_frame_begin(t);
+			frame_open = true;
+		} else if (sharded) {
+			/* until the next frame, or until a shard is done */
+			uint64_t wait = SHARD_TIMEOUT * 1000 * 1000;
+			if (fps && !overloaded) {
+				uint64_t next = start + frame * 1e9 / fps;
+				if (next < now + wait)
+					wait = next > now ? next - now : 0;
+			}
+			err = shard_error();
+			if (err)
+				return err;
+			shard_wait(wait / 1000 / 1000);
+			continue;
+		} else if (!pending) {
+			/*
+			 * idle until the next frame, or until rate-capped areas
+			 * are due, the sockets have drained, or pixels should be
+			 * read back; pf_send takes care of all of those
+			 */
+			uint64_t wait = UINT64_MAX;
+			if (!pf_overloaded()) {
+				uint64_t next = start + frame * 1e9 / fps;
+				wait = next > now ? next - now : 0;
+			}
+			if (pf_wake_ms() >= 0 && (uint64_t) pf_wake_ms() * 1000 * 1000 < wait)
+				wait = (uint64_t) pf_wake_ms() * 1000 * 1000;
+			struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+			nanosleep(&ts, NULL);
+		}
+
+		err = pf_send(fb, options.bgcolor);
+		if (err)
+			return err;
+
+		if (frame_open && !pf_pending()) {
+			trace_frame_end();
+			stats_frame_end();
+			frame_open = false;
+		}
+	}
+	const uint64_t elapsed = stats_now() - start;
+
+	shard_stop();
+	if (relay_fd >= 0) {
+		relay_stop = 1;
+		pthread_join(relay_thread, NULL);
+		close(relay_fd);
+	}
+	metrics_stop();
+	trace_close();
+	pf_close();
+
+	FILE *f = output ? fopen(output, "w") : stdout;
+	if (f == NULL) {
+		perror("couldn't open benchmark output");
+		return ERR_BADARG;
+	}
+	stats_json(f, elapsed);
+	if (f != stdout)
+		fclose(f);
+
+	free(fb);
+
+	return 0;
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
@@ -20,6 +20,9 @@
 #define ERR_PF_RECV	25
 #define ERR_PF_ACCEL	26
 
+/* metrics errors */
+#define ERR_METRICS	40
+
 /* non-errors (should never exit with these) */
 #define EXCEPTION_PT_FINISHED	30
 #define EXCEPTION_INT		31
@@ -1,18 +1,23 @@
 #include <dirent.h>	/* readdir */
 #include <signal.h>	/* sig_atomic_t */
 #include <stdio.h>	/* perror, printf */
-#include <stdlib.h>	/* calloc */
+#include <stdlib.h>	/* calloc, free */
 #include <sys/epoll.h>	/* epoll */
 #include <unistd.h>	/* close */
 
 #include "error.h"	/* ERR_* */
 #include "evdi_lib.h"	/* evdi_* */
+#include "stats.h"	/* stats_now */
 
 #include "evdi.h"
 
 #define BYTES_PER_PIXEL 4
 #define RECTS 16
-#define FRAMEBUFFERS 2
+/*
+ * pixelflut.c keeps its own copy of what it sent, so a single framebuffer that
+ * accumulates every update is all we need.
+ */
+#define FRAMEBUFFERS 1
 
 /* binary data included from *.edid file */
 #define EDID_OBJNAME _binary_thinkpad_edid_start
@@ -27,6 +32,12 @@ static bool evdi_connected;
 static struct evdi_buffer ebufs[FRAMEBUFFERS];
 static bool ebuf_registered[FRAMEBUFFERS];
 static volatile sig_atomic_t ebuf_ready_fbid;
+static uint64_t ebuf_ready_time;
+
+/* pointer, from cursor events */
+static bool cursor_enabled;
+static int cursor_hot_x, cursor_hot_y;
+static int cursor_x, cursor_y;
 
 static struct evdi_rect internal_rects[RECTS][FRAMEBUFFERS];
 static struct evdi_rect rects[RECTS];
@@ -44,9 +55,32 @@ static int epoll_fd;
 static void update_ready_handler(int fbid, void *_)
 {
 	(void) _;
+	ebuf_ready_time = stats_now();
 	ebuf_ready_fbid = fbid;
 }
 
+/*
+ * cursor_set_handler is called when the pointer changes shape or is shown or
+ * hidden. Cursor events only come if the module was loaded with
+ * enable_cursor_blending=0, otherwise the pointer is part of the pixels.
+ */
+static void cursor_set_handler(struct evdi_cursor_set cursor_set, void *_)
+{
+	(void) _;
+	cursor_enabled = cursor_set.enabled;
+	cursor_hot_x = cursor_set.hot_x;
+	cursor_hot_y = cursor_set.hot_y;
+	free(cursor_set.buffer);
+}
+
+/* cursor_move_handler is called when the pointer moves. */
+static void cursor_move_handler(struct evdi_cursor_move cursor_move, void *_)
+{
+	(void) _;
+	cursor_x = cursor_move.x;
+	cursor_y = cursor_move.y;
+}
+
 /*
  * get_first_device looks through registered cardX entries in /dev/dri to try
  * to find one managed by EVDI; returns -1 if it can't find one
@@ -92,20 +126,28 @@ static int setup_epoll(void)
 	return 0;
 }
 
-static int evdi_wait(void)
+/*
+ * evdi_wait handles EVDI events until there are some, or until timeout_ms has
+ * passed, or forever if timeout_ms is negative.
+ */
+static int evdi_wait(int timeout_ms)
 {
 	struct epoll_event event;
+	const uint64_t deadline = stats_now() + (uint64_t) timeout_ms * 1000 * 1000;
 
 	for (;;) {
-		int w = epoll_wait(epoll_fd, &event, 1 /* events */, 1 /* ms */);
+		int w = epoll_wait(epoll_fd, &event, 1 /* events */, timeout_ms ? 1 : 0 /* ms */);
 
 		/* SIGINT */
 		if (doomed)
 			return EXCEPTION_INT;
 
 		/* timeout */
-		if (!w)
+		if (!w) {
+			if (timeout_ms >= 0 && stats_now() >= deadline)
+				return 0;
 			continue;
+		}
 
 		/* epoll error */
 		if (w == -1) {
@@ -180,6 +222,8 @@ int evdi_setup(void)
 
 	/* register event handlers */
 	econtext.update_ready_handler = update_ready_handler;
+	econtext.cursor_set_handler = cursor_set_handler;
+	econtext.cursor_move_handler = cursor_move_handler;
 
 	return 0;
 }
@@ -220,28 +264,51 @@ void evdi_cleanup(void)
 	}
 }
 
-int evdi_get(struct evdi_update *update)
+int evdi_get_timeout(struct evdi_update *update, int timeout_ms)
 {
-	/* TODO: cycle safely through framebuffers using shared memory */
-	static int fbid = 0;
-	fbid ^= 1;
+	static bool requested;
+	const int fbid = 0;
 
-	bool ready_immediately = evdi_request_update(ehandle, fbid);
-	if (!ready_immediately) {
+	update->fb = ebufs[fbid].buffer;
+	update->rects = rects;
+	update->num_rects = 0;
+	update->cursor_x = cursor_enabled ? cursor_x + cursor_hot_x : -1;
+	update->cursor_y = cursor_enabled ? cursor_y + cursor_hot_y : -1;
+
+	/* an update requested earlier but not ready yet stays requested */
+	if (!requested && evdi_request_update(ehandle, fbid)) {
+		update->ready = stats_now();
+	} else {
+		requested = true;
+		const uint64_t deadline = stats_now() + (uint64_t) timeout_ms * 1000 * 1000;
 		while (ebuf_ready_fbid != fbid) {
-			int err = evdi_wait();
+			uint64_t now = stats_now();
+			if (timeout_ms >= 0 && now >= deadline)
+				return 0;
+
+			int err = evdi_wait(timeout_ms < 0 ? -1 : (int) ((deadline - now) / (1000 * 1000)));
 			if (doomed)
 				return EXCEPTION_INT;
 			if (err)
 				return err;
 		}
+		requested = false;
 		ebuf_ready_fbid = -1;
+		update->ready = ebuf_ready_time;
 	}
 
 	evdi_grab_pixels(ehandle, rects, &update->num_rects);
-	update->fb = ebufs[fbid].buffer;
-	update->rects = rects;
 	return 0;
 }
 
+int evdi_get(struct evdi_update *update)
+{
+	return evdi_get_timeout(update, -1);
+}
+
+int evdi_poll(struct evdi_update *update)
+{
+	return evdi_get_timeout(update, 0);
+}
+
 /* vi: set ts=8 sts=8 sw=8 noet: */
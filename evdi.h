@@ -6,10 +6,15 @@ struct evdi_rect {
 };
 #endif
 
+#include <stdint.h>	/* uint64_t */
+
 struct evdi_update {
 	unsigned char *fb;
 	struct evdi_rect *rects;
 	int num_rects;
+	uint64_t ready;		/* when EVDI reported the update ready, see stats_now */
+	int cursor_x;		/* pointer hot spot, or -1 while hidden or unknown */
+	int cursor_y;
 };
 
 /*
@@ -34,4 +39,14 @@ void evdi_cleanup(void);
  */
 int evdi_get(struct evdi_update *update);
 
+/*
+ * evdi_get_timeout is evdi_get, but gives up waiting after timeout_ms, or
+ * never if timeout_ms is negative. If no update is ready by then,
+ * update->num_rects is 0, but update->fb still points to the framebuffer.
+ */
+int evdi_get_timeout(struct evdi_update *update, int timeout_ms);
+
+/* evdi_poll is evdi_get_timeout without the waiting. */
+int evdi_poll(struct evdi_update *update);
+
 /* vi: set ts=8 sts=8 sw=8 noet: */
@@ -1,13 +1,19 @@
 #include <signal.h>	/* sigaction, sig_atomic_t */
 #include <stdbool.h>	/* bool, true, false */
 #include <stdio.h>	/* perror, printf */
-#include <stdlib.h>	/* atoi, strtoul */
+#include <stdlib.h>	/* atoi, strtod */
 #include <string.h>	/* memset */
+#include <time.h>	/* nanosleep */
 #include <unistd.h>	/* close, getopt */
 
 #include "pixelflut.h"	/* pf_connect */
 #include "error.h"	/* ERR_* */
 #include "evdi.h"	/* evdi_setup, evdi_cleanup, evdi_get */
+#include "metrics.h"	/* metrics_start, metrics_stop */
+#include "options.h"	/* options, options_* */
+#include "shard.h"	/* shard_* */
+#include "stats.h"	/* stats_* */
+#include "trace.h"	/* trace_* */
 
 #define EPOLL_TIMEOUT 100 /* ms */
 #define EPOLL_NUM_EVENTS 1
@@ -16,10 +22,14 @@
 
 #define DEFAULT_HOSTNAME	"localhost"
 #define DEFAULT_PORT		1337
-#define DEFAULT_CONNECTIONS	8
+
+/* longest performance test, so its length fits in nanoseconds */
+#define PT_MAX_SECONDS		(365.0 * 24 * 60 * 60)
 
 /* performance test */
 bool pt_active;
+static uint64_t pt_start;
+static uint64_t pt_duration;
 
 volatile sig_atomic_t doomed;
 
@@ -32,9 +42,10 @@ static void interrupt(int _, siginfo_t *__, void *___)
 	doomed = 1;
 }
 
-static int loop(int width, uint32_t bgcolor)
+static int loop(uint32_t bgcolor)
 {
 	struct evdi_update update;
+	bool frame_open = false;
 
 	int DEBUG_alternate = 0;
 	for (;;) {
@@ -42,27 +53,99 @@ static int loop(int width, uint32_t bgcolor)
 		if (doomed)
 			return EXCEPTION_INT;
 
-		int err = evdi_get(&update);
+		/*
+		 * while damage is pending, only pick up frames that are ready
+		 * anyway, and none while overloaded: EVDI merges the damage of
+		 * the frames we skip into the next one. Otherwise wait for one,
+		 * or until rate-capped areas are due.
+		 */
+		uint64_t t_capture = stats_now();
+		int err = 0;
+		if (pf_overloaded()) {
+			update.num_rects = 0;
+
+			/* let the sockets drain */
+			if (!pf_pending()) {
+				int wait = pf_wake_ms();
+				struct timespec ts = { wait / 1000, wait % 1000 * 1000 * 1000 };
+				nanosleep(&ts, NULL);
+			}
+		} else if (pf_pending())
+			err = evdi_poll(&update);
+		else
+			err = evdi_get_timeout(&update, pf_wake_ms());
 		if (err)
 			return err;
 
-		for (int rect = 0; rect < update.num_rects; rect++) {
+		pf_cursor(update.cursor_x, update.cursor_y);
+		if (update.num_rects) {
+			uint64_t damaged = 0;
+			for (int rect = 0; rect < update.num_rects; rect++) {
 #ifdef DEBUG
-			printf(DEBUG_alternate ? ". " : " .");
-			printf("DEBUG %dx%d (%d of %d)\n",
-					update.rects[rect].x2 - update.rects[rect].x1, // DEBUG
-					update.rects[rect].y2 - update.rects[rect].y1, // DEBUG
-					rect + 1, update.num_rects // DEBUG
-			); fflush(stdout); // DEBUG
+				printf(DEBUG_alternate ? ". " : " .");
+				printf("DEBUG %dx%d (%d of %d)\n",
+						update.rects[rect].x2 - update.rects[rect].x1, // DEBUG
+						update.rects[rect].y2 - update.rects[rect].y1, // DEBUG
+						rect + 1, update.num_rects // DEBUG
+				); fflush(stdout); // DEBUG
 #endif
 
-			err = pf_set_buf((uint32_t *) update.fb, width,
-					update.rects[rect].x1, update.rects[rect].x2,
-					update.rects[rect].y1, update.rects[rect].y2,
-					bgcolor);
-			if (err)
-				return err;
+				damaged += (update.rects[rect].x2 - update.rects[rect].x1) * (update.rects[rect].y2 - update.rects[rect].y1);
+				pf_damage(update.rects[rect].x1, update.rects[rect].x2,
+						update.rects[rect].y1, update.rects[rect].y2);
+			}
+			stats_stage_add(STAGE_CAPTURE, stats_now() - t_capture, damaged);
+			trace_frame_begin(update.ready);
+			frame_open = true;
+		}
+
+		err = pf_send((uint32_t *) update.fb, bgcolor);
+		if (err)
+			return err;
+
+		if (frame_open && !pf_pending()) {
+			trace_frame_end();
+			stats_frame_end();
+			frame_open = false;
 		}
+
+		if (pt_active && stats_now() - pt_start >= pt_duration)
+			return EXCEPTION_PT_FINISHED;
+	}
+
+	return 0;
+}
+
+/*
+ * shard_loop grabs frames from EVDI and passes their damage on to the shards,
+ * which send it at their own pace
+ */
+static int shard_loop(void)
+{
+	struct evdi_update update;
+
+	for (;;) {
+		if (doomed)
+			return EXCEPTION_INT;
+
+		int err = shard_error();
+		if (err)
+			return err;
+
+		/* skip frames while every shard is overloaded, as loop does */
+		if (shard_overloaded()) {
+			shard_wait(EPOLL_TIMEOUT);
+			continue;
+		}
+
+		err = evdi_get_timeout(&update, EPOLL_TIMEOUT);
+		if (err)
+			return err;
+		if (update.num_rects)
+			shard_damage((uint32_t *) update.fb, update.rects, update.num_rects, update.ready, update.cursor_x, update.cursor_y);
+
+		if (pt_active && stats_now() - pt_start >= pt_duration)
+			return EXCEPTION_PT_FINISHED;
 	}
 
 	return 0;
@@ -76,21 +159,24 @@ static int usage(char *progname)
 		"  sudo %s [options...] [HOST [PORT]] \n"
 		"\n"
 		"Arguments:\n"
-		"  HOST			pixelflut hostname (default " DEFAULT_HOSTNAME ")\n"
+		"  HOST			pixelflut hostname, unix:PATH, shm:PATH or relay:HOST (default " DEFAULT_HOSTNAME ")\n"
 		"  PORT			pixelflut port (default %d)\n"
 		"\n"
 		"Options:\n"
-		"  -a			use async i/o\n"
-		"  -b RRGGBB		occasionally blit every pixel except this one\n"
-		"  -c CONNECTIONS	size of pixelflut connection pool (default %d)\n"
-		"  -d WxH		scale down to width W and height H\n"
-		"  -o X,Y		move the top-left corner down by Y pixels and right by X pixels\n"
-		"  -s			increase SO_SNDBUF socket buffers by 2x (can pass multiple times)\n"
-		"  -p			do a performance test (time five screen updates)\n"
 		"",
 		progname,
-		DEFAULT_PORT,
-		DEFAULT_CONNECTIONS
+		DEFAULT_PORT
+	);
+	options_usage(true);
+	fprintf(stderr,
+		"  -S FILE		drive a wall of servers listed in FILE, each showing a region of the monitor\n"
+		"  -M HOST[:PORT]	also show the monitor on HOST, at its own pace (can pass multiple times)\n"
+		"  -d WxH		scale down to width W and height H\n"
+		"  -o X,Y		move the top-left corner down by Y pixels and right by X pixels\n"
+		"  -p SECONDS		benchmark for this long, then print JSON results and exit\n"
+		"  -j FILE		write benchmark results to FILE instead of stdout\n"
+		"  -t FILE		write a Chrome trace of every frame and rect to FILE\n"
+		""
 	);
 	return ERR_BADARG;
 }
@@ -109,38 +195,32 @@ int main(int argc, char *argv[])
 	}
 
 	/* parse flags and options */
-	bool asyncio = false;
-	int connections = DEFAULT_CONNECTIONS;
-	int sndbuf_shift = 0;
 	pt_active = false;
+	char *pt_output = NULL;
+	double pt_secs;
+	char *trace_path = NULL;
 
 	/* TODO implement */
 	int constrain_width = 0;
 	int constrain_height = 0;
 
-	/* TODO implement */
 	int origin_x = 0;
 	int origin_y = 0;
 
-	uint32_t bgcolor = PF_NO_BGCOLOR;
+	char *shards_path = NULL;
+	char *mirrors[SHARD_MAX];
+	int num_mirrors = 0;
 
 	char c;
 	int opt;
-	while ((opt = getopt(argc, argv, "ab:c:d:o:sph?")) != -1) {
+	while ((opt = getopt(argc, argv, OPTIONS_POOL OPTIONS_FRAMES "d:j:M:o:p:S:t:h?")) != -1) {
+		int err = options_parse(opt, optarg);
+		if (err > 0)
+			return usage(argv[0]);
+		if (!err)
+			continue;
+
 		switch (opt) {
-		case 'a':
-			asyncio = true;
-			break;
-		case 'b':
-			bgcolor = strtoul(optarg, NULL, 16);
-			if (bgcolor > 0x00ffffff)
-				return usage(argv[0]);
-			break;
-		case 'c':
-			connections = atoi(optarg);
-			if (connections <= 0)
-				return usage(argv[0]);
-			break;
 		case 'd':
 			constrain_width = atoi(optarg);
 			if (constrain_width <= 0)
@@ -169,11 +249,27 @@ int main(int argc, char *argv[])
 			if (origin_y <= 0)
 				return usage(argv[0]);
 			break;
-		case 's':
-			sndbuf_shift++;
+		case 'S':
+			shards_path = optarg;
+			break;
+		case 'M':
+			if (num_mirrors == SHARD_MAX)
+				return usage(argv[0]);
+			mirrors[num_mirrors++] = optarg;
 			break;
 		case 'p':
+			/* also false for NaN */
+			pt_secs = strtod(optarg, NULL);
+			if (!(pt_secs > 0 && pt_secs <= PT_MAX_SECONDS))
+				return usage(argv[0]);
 			pt_active = true;
+			pt_duration = pt_secs * 1000 * 1000 * 1000;
+			break;
+		case 'j':
+			pt_output = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
 			break;
 		case 'h':
 		case '?':
@@ -200,18 +296,47 @@ int main(int argc, char *argv[])
 	if (optind < argc)
 		return usage(argv[0]);
 
-	int err = pf_connect(connections, hostname, port);
-	if (err)
-		return err;
+	stats_register();
 
-	if (asyncio) {
-		err = pf_asyncio();
+	if (trace_path) {
+		int err = trace_open(trace_path);
 		if (err)
 			return err;
 	}
 
-	if (sndbuf_shift) {
-		err = pf_increase_sndbuf(sndbuf_shift);
+	const int width = 800; // DEBUG
+	const int height = 600; // DEBUG
+	struct shard_config server = {
+		.host = hostname,
+		.port = port,
+		.connections = options.connections,
+		.region = { 0, 0, width, height },
+		.width = width,
+		.height = height,
+		.offset_x = origin_x,
+		.offset_y = origin_y,
+		.rate_cap = options.rate_cap,
+	};
+
+	const bool sharded = shards_path || num_mirrors;
+	int err;
+	if (!sharded)
+		err = options_setup(&server);
+	else if (shards_path)
+		err = shard_load(shards_path, &server);
+	else
+		err = shard_add(&server);
+	for (int i = 0; i < num_mirrors && !err; i++)
+		err = shard_mirror(mirrors[i], &server);
+	if (sharded && !err)
+		err = shard_start(options_setup, width, height, options.bgcolor);
+	if (err) {
+		shard_stop();
+		return err;
+	}
+
+	if (options.metrics_addr) {
+		err = metrics_start(options.metrics_addr);
 		if (err)
 			return err;
 	}
@@ -220,11 +345,28 @@ int main(int argc, char *argv[])
 	if (err)
 		return err;
 
-	const int width = 800; // DEBUG
-	err = loop(width, bgcolor);
+	pt_start = stats_now();
+	err = sharded ? shard_loop() : loop(options.bgcolor);
 	if (err == EXCEPTION_PT_FINISHED || err == EXCEPTION_INT)
 		err = 0;
 
+	/* the shards' counters are complete once they're done */
+	shard_stop();
+
+	if (pt_active) {
+		FILE *f = pt_output ? fopen(pt_output, "w") : stdout;
+		if (f == NULL) {
+			perror("couldn't open benchmark output");
+		} else {
+			stats_json(f, stats_now() - pt_start);
+			if (f != stdout)
+				fclose(f);
+		}
+	}
+
+	metrics_stop();
+	trace_close();
+
 	pf_close();
 
 	evdi_cleanup();
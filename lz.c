@@ -0,0 +1,146 @@
+#include <string.h>	/* memcpy */
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* the format wants the last 5 bytes as literals, and no match in the last 12 */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* put_len writes the extension bytes of a literal or match length */
+static uint8_t *put_len(uint8_t *op, int len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/*
+ * put_sequence writes num_literals literals followed by a match of match_len
+ * bytes offset bytes back, or by nothing if match_len is 0
+ */
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *literals, int num_literals, int offset, int match_len)
+{
+	const int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+	uint8_t *token = op++;
+	*token = (num_literals < 15 ? num_literals : 15) << 4 | (ml < 15 ? ml : 15);
+
+	if (num_literals >= 15)
+		op = put_len(op, num_literals - 15);
+	memcpy(op, literals, num_literals);
+	op += num_literals;
+
+	if (!match_len)
+		return op;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if (ml >= 15)
+		op = put_len(op, ml - 15);
+	return op;
+}
+
+int lz_compress(const uint8_t *src, int len, uint8_t *dst)
+{
+	int table[1 << LZ_HASH_BITS];
+	uint8_t *op = dst;
+	int anchor = 0;
+
+	for (int h = 0; h < 1 << LZ_HASH_BITS; h++)
+		table[h] = -1;
+
+	for (int i = 0; i < len - LZ_MATCH_LIMIT;) {
+		const uint32_t v = read32(src + i);
+		const int h = hash(v);
+		const int ref = table[h];
+		table[h] = i;
+		if (ref < 0 || i - ref > LZ_MAX_OFFSET || read32(src + ref) != v) {
+			i++;
+			continue;
+		}
+
+		int m = LZ_MIN_MATCH;
+		while (i + m < len - LZ_LAST_LITERALS && src[ref + m] == src[i + m])
+			m++;
+		op = put_sequence(op, src + anchor, i - anchor, i - ref, m);
+		i += m;
+		anchor = i;
+	}
+
+	op = put_sequence(op, src + anchor, len - anchor, 0, 0);
+	return op - dst;
+}
+
+/* get_len adds the extension bytes of a length at *ip to len, or returns -1 */
+static int get_len(const uint8_t **ip, const uint8_t *end, int len)
+{
+	int b;
+	do {
+		if (*ip == end || len > 1 << 30)
+			return -1;
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap)
+{
+	const uint8_t *ip = src, *end = src + len;
+	int out = 0;
+
+	while (ip < end) {
+		const int token = *ip++;
+
+		int n = token >> 4;
+		if (n == 15)
+			n = get_len(&ip, end, n);
+		if (n < 0 || n > end - ip || n > cap - out)
+			return -1;
+		memcpy(dst + out, ip, n);
+		ip += n;
+		out += n;
+
+		/* the last sequence has literals only */
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -1;
+		const int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!offset || offset > out)
+			return -1;
+
+		int m = token & 15;
+		if (m == 15)
+			m = get_len(&ip, end, m);
+		if (m < 0)
+			return -1;
+		m += LZ_MIN_MATCH;
+		if (m > cap - out)
+			return -1;
+
+		/* the match may overlap what it copies */
+		for (int k = 0; k < m; k++, out++)
+			dst[out] = dst[out - offset];
+	}
+	return out;
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
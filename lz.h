@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>	/* uint8_t */
+
+/* LZ_BOUND is the most bytes lz_compress writes for len bytes of input */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+/*
+ * lz_compress compresses len bytes at src into dst, which must have room for
+ * LZ_BOUND(len) bytes, in the LZ4 block format, so anything that reads LZ4
+ * blocks can read it. Matches are found greedily with a small hash table,
+ * which is fast rather than tight. Returns the compressed length.
+ */
+int lz_compress(const uint8_t *src, int len, uint8_t *dst);
+
+/*
+ * lz_decompress decompresses the LZ4 block of len bytes at src into dst, which
+ * has room for cap bytes. Returns the decompressed length, or -1 if the block
+ * is malformed or doesn't fit.
+ */
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
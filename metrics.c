@@ -0,0 +1,310 @@
+#include <errno.h>	/* errno, EINTR, ECONNABORTED */
+#include <netdb.h>	/* getaddrinfo */
+#include <pthread.h>	/* pthread_create, pthread_join */
+#include <stdbool.h>	/* bool, true, false */
+#include <stdio.h>	/* perror, open_memstream */
+#include <stdlib.h>	/* free */
+#include <string.h>	/* memcpy, strdup, strncmp, strrchr */
+#include <sys/socket.h>	/* socket, bind, listen, accept, setsockopt, shutdown */
+#include <sys/time.h>	/* timeval */
+#include <sys/un.h>	/* sockaddr_un */
+#include <unistd.h>	/* close, read, unlink, usleep, write */
+
+#include "error.h"	/* ERR_* */
+#include "pixelflut.h"	/* pf_backlog_ms, pf_num_conns, pf_conn_stats */
+#include "stats.h"	/* stats_sum */
+#include "trace.h"	/* trace_frame_age */
+
+#include "metrics.h"
+
+#define METRICS_BACKLOG 8
+#define REQUEST_LEN 1024
+#define REQUEST_TIMEOUT_MS 1000	/* a scrape may take this long to send or read */
+#define ACCEPT_BACKOFF_MS 100	/* pause after accept fails, say out of fds */
+
+/* exported latency buckets run from 1 us to about 4 s in powers of two */
+#define LATENCY_BUCKETS 23
+
+static int listen_fd = -1;
+static char *unix_path;
+static pthread_t thread;
+static bool running;
+static volatile bool stopping;
+
+static void counter(FILE *f, const char *name, const char *help, uint64_t value)
+{
+	fprintf(f, "# HELP kernelflut_%s %s\n", name, help);
+	fprintf(f, "# TYPE kernelflut_%s counter\n", name);
+	fprintf(f, "kernelflut_%s %llu\n", name, (unsigned long long) value);
+}
+
+/* histogram writes h, holding nanoseconds, as one series of a histogram in seconds */
+static void histogram(FILE *f, const char *name, const char *label, const char *value, const struct hist *h)
+{
+	for (int b = 0; b < LATENCY_BUCKETS; b++) {
+		uint64_t le_ns = 1000ull << b;
+		fprintf(f, "kernelflut_%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n",
+				name, label, value, le_ns / 1e9,
+				(unsigned long long) hist_count_le(h, le_ns));
+	}
+	fprintf(f, "kernelflut_%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n",
+			name, label, value, (unsigned long long) h->count);
+	fprintf(f, "kernelflut_%s_sum{%s=\"%s\"} %.9f\n", name, label, value, h->sum / 1e9);
+	fprintf(f, "kernelflut_%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long) h->count);
+}
+
+/* render writes every metric to f */
+static void render(FILE *f)
+{
+	static struct stats total;
+	stats_sum(&total);
+
+	counter(f, "frames_total", "Frames grabbed from EVDI.", total.frames);
+	counter(f, "frames_dropped_total", "Frames superseded by a newer one before they were sent.", total.frames_dropped);
+	counter(f, "rects_total", "Damage rectangles processed.", total.rects);
+	counter(f, "pixels_considered_total", "Pixels inside damage rectangles.", total.pixels_considered);
+	counter(f, "pixels_skipped_total", "Damaged pixels not sent because the canvas already has them.", total.pixels_skipped);
+	counter(f, "pixels_sent_total", "Pixels sent to pixelflut.", total.pixels_sent);
+	counter(f, "syscalls_total", "Write system calls on pixelflut sockets.", total.syscalls);
+	counter(f, "eagain_total", "Writes stalled because a socket buffer was full.", total.eagain);
+	counter(f, "conn_failures_total", "Pixelflut connections that dropped.", total.conn_failures);
+	counter(f, "reconnects_total", "Pixelflut connections opened in the background, after dropping or to grow the pool.", total.reconnects);
+	counter(f, "pixels_replayed_total", "Pixels queued for resending because their connection dropped.", total.pixels_replayed);
+	counter(f, "tiles_moved_total", "Tiles handed to another connection to balance the pool.", total.tiles_moved);
+	counter(f, "pixels_calmed_total", "Flickering pixels held instead of sent.", total.pixels_calmed);
+	counter(f, "bytes_calmed_total", "Bytes not sent because flickering pixels were held.", total.bytes_calmed);
+	counter(f, "pixels_verified_total", "Pixels read back from pixelflut and compared.", total.pixels_verified);
+	counter(f, "pixels_overwritten_total", "Pixels read back that another client had painted over.", total.pixels_overwritten);
+	counter(f, "zerocopy_sends_total", "Writes sent from pinned buffers with MSG_ZEROCOPY.", total.zerocopy_sends);
+	counter(f, "zerocopy_copied_total", "MSG_ZEROCOPY writes the kernel copied anyway.", total.zerocopy_copied);
+
+	fprintf(f, "# HELP kernelflut_frame_age_seconds How long ago the oldest damage being sent was reported ready.\n");
+	fprintf(f, "# TYPE kernelflut_frame_age_seconds gauge\n");
+	fprintf(f, "kernelflut_frame_age_seconds %.9f\n", trace_frame_age() / 1e9);
+
+	fprintf(f, "# HELP kernelflut_backlog_seconds Estimated time to send the pending damage.\n");
+	fprintf(f, "# TYPE kernelflut_backlog_seconds gauge\n");
+	fprintf(f, "kernelflut_backlog_seconds %.3f\n", pf_backlog_ms() / 1e3);
+
+	int num_conns = pf_num_conns();
+	struct pf_conn_stats cs[num_conns ? num_conns : 1];
+	for (int i = 0; i < num_conns; i++)
+		pf_conn_stats(i, &cs[i]);
+
+	fprintf(f, "# HELP kernelflut_pool_connections Connections currently in the pixelflut pool.\n");
+	fprintf(f, "# TYPE kernelflut_pool_connections gauge\n");
+	fprintf(f, "kernelflut_pool_connections %d\n", num_conns);
+
+	fprintf(f, "# HELP kernelflut_conn_bytes_sent_total Bytes accepted by each pixelflut socket.\n");
+	fprintf(f, "# TYPE kernelflut_conn_bytes_sent_total counter\n");
+	for (int i = 0; i < num_conns; i++)
+		fprintf(f, "kernelflut_conn_bytes_sent_total{conn=\"%d\"} %llu\n", i, (unsigned long long) cs[i].bytes);
+
+	fprintf(f, "# HELP kernelflut_conn_up Whether each pixelflut connection is up.\n");
+	fprintf(f, "# TYPE kernelflut_conn_up gauge\n");
+	for (int i = 0; i < num_conns; i++)
+		fprintf(f, "kernelflut_conn_up{conn=\"%d\"} %d\n", i, cs[i].up);
+
+	fprintf(f, "# HELP kernelflut_conn_queue_bytes Bytes queued on each pixelflut connection.\n");
+	fprintf(f, "# TYPE kernelflut_conn_queue_bytes gauge\n");
+	for (int i = 0; i < num_conns; i++) {
+		fprintf(f, "kernelflut_conn_queue_bytes{conn=\"%d\",queue=\"user\"} %d\n", i, cs[i].buffered);
+		fprintf(f, "kernelflut_conn_queue_bytes{conn=\"%d\",queue=\"kernel\"} %d\n", i, cs[i].unsent);
+	}
+
+	fprintf(f, "# HELP kernelflut_conn_sndbuf_bytes Send buffer size of each pixelflut socket.\n");
+	fprintf(f, "# TYPE kernelflut_conn_sndbuf_bytes gauge\n");
+	for (int i = 0; i < num_conns; i++)
+		fprintf(f, "kernelflut_conn_sndbuf_bytes{conn=\"%d\"} %d\n", i, cs[i].sndbuf);
+
+	fprintf(f, "# HELP kernelflut_stage_seconds Time per frame spent in each pipeline stage.\n");
+	fprintf(f, "# TYPE kernelflut_stage_seconds histogram\n");
+	for (int s = 0; s < STAGES; s++)
+		histogram(f, "stage_seconds", "stage", stats_stage_names[s], &total.stage[s].latency);
+
+	fprintf(f, "# HELP kernelflut_latency_seconds Time from EVDI reporting an update until each point of its delivery.\n");
+	fprintf(f, "# TYPE kernelflut_latency_seconds histogram\n");
+	for (int l = 0; l < LATENCIES; l++)
+		histogram(f, "latency_seconds", "span", stats_latency_names[l], &total.latency[l]);
+}
+
+/* write_all writes len bytes of buf to fd, giving up on error */
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* serve answers one HTTP request on fd, whatever it asks for */
+static void serve(int fd)
+{
+	/* wait for the request so clients don't see a reset */
+	char req[REQUEST_LEN];
+	if (read(fd, req, sizeof(req)) <= 0)
+		return;
+
+	char *body;
+	size_t body_len;
+	FILE *f = open_memstream(&body, &body_len);
+	if (f == NULL)
+		return;
+	render(f);
+	fclose(f);
+
+	char header[128];
+	int header_len = snprintf(header, sizeof(header),
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n", body_len);
+	write_all(fd, header, header_len);
+	write_all(fd, body, body_len);
+	free(body);
+}
+
+static void *metrics_run(void *_)
+{
+	(void) _;
+
+	/* a client that never asks can't hold up the others, or metrics_stop */
+	const struct timeval timeout = {
+		.tv_sec = REQUEST_TIMEOUT_MS / 1000,
+		.tv_usec = REQUEST_TIMEOUT_MS % 1000 * 1000,
+	};
+
+	while (!stopping) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd == -1) {
+			if (stopping)
+				break;
+			if (errno != EINTR && errno != ECONNABORTED)
+				usleep(ACCEPT_BACKOFF_MS * 1000);
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* metrics_listen_unix binds a stream socket at path. Returns the fd or -1. */
+static int metrics_listen_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "metrics socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	unix_path = strdup(path);
+	return fd;
+}
+
+/* metrics_listen_tcp binds a stream socket at [host:]port. Returns the fd or -1. */
+static int metrics_listen_tcp(const char *addr)
+{
+	char host[256] = "127.0.0.1";
+	const char *port = addr;
+	const char *colon = strrchr(addr, ':');
+	if (colon) {
+		size_t len = colon - addr;
+		if (len >= sizeof(host))
+			return -1;
+		memcpy(host, addr, len);
+		host[len] = '\0';
+		port = colon + 1;
+	}
+
+	struct addrinfo *res;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	if (getaddrinfo(host, port, &hints, &res))
+		return -1;
+
+	int fd = -1;
+	for (struct addrinfo *p = res; p; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, p->ai_addr, p->ai_addrlen))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+int metrics_start(const char *addr)
+{
+	if (!strncmp(addr, "unix:", 5))
+		listen_fd = metrics_listen_unix(addr + 5);
+	else
+		listen_fd = metrics_listen_tcp(addr);
+
+	if (listen_fd == -1 || listen(listen_fd, METRICS_BACKLOG)) {
+		perror("couldn't open metrics endpoint");
+		metrics_stop();
+		return ERR_METRICS;
+	}
+
+	stopping = false;
+	if (pthread_create(&thread, NULL, metrics_run, NULL)) {
+		perror("couldn't start metrics thread");
+		metrics_stop();
+		return ERR_METRICS;
+	}
+	running = true;
+
+	return 0;
+}
+
+void metrics_stop(void)
+{
+	if (running) {
+		stopping = true;
+
+		/* wakes the thread up from accept */
+		shutdown(listen_fd, SHUT_RDWR);
+		pthread_join(thread, NULL);
+		running = false;
+	}
+
+	if (listen_fd != -1) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+
+	if (unix_path) {
+		unlink(unix_path);
+		free(unix_path);
+		unix_path = NULL;
+	}
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
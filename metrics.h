@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+ * metrics_start serves the counters in stats.h and pixelflut.h in Prometheus
+ * text format over HTTP from a background thread. addr is either
+ * "unix:/path/to/socket" or "[HOST:]PORT"; HOST defaults to 127.0.0.1.
+ * Returns 0 on success. If return value is 0, metrics_stop MUST be called
+ * before the connection pool is closed.
+ */
+int metrics_start(const char *addr);
+
+/*
+ * metrics_stop shuts down the metrics endpoint and waits for its thread to
+ * exit. Redundant calls are safe.
+ */
+void metrics_stop(void);
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
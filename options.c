@@ -0,0 +1,241 @@
+#include <stdbool.h>	/* bool, true */
+#include <stdio.h>	/* fprintf */
+#include <stdlib.h>	/* atoi, strtod, strtoul */
+#include <string.h>	/* strchr, strcmp */
+
+#include "error.h"	/* ERR_* */
+#include "order.h"	/* order_names, ORDER_* */
+#include "pixelflut.h"	/* pf_* */
+#include "shard.h"	/* struct shard_config */
+
+#include "options.h"
+
+struct options options = {
+	.connections = DEFAULT_CONNECTIONS,
+	.connect_timeout = DEFAULT_CONNECT_TIMEOUT,
+	.assign = PF_ASSIGN_PIXELS,
+	.order = ORDER_INTERLEAVE,
+	.upscale = 1,
+	.bgcolor = PF_NO_BGCOLOR,
+};
+
+int options_parse(int opt, char *arg)
+{
+	switch (opt) {
+	case 'a':
+		options.asyncio = true;
+		break;
+	case 'A':
+		options.assign = PF_ASSIGNS;
+		for (int a = 0; a < PF_ASSIGNS; a++)
+			if (!strcmp(arg, pf_assign_names[a]))
+				options.assign = a;
+		if (options.assign == PF_ASSIGNS)
+			return ERR_BADARG;
+		break;
+	case 'O':
+		options.order = ORDERS;
+		for (int o = 0; o < ORDERS; o++)
+			if (!strcmp(arg, order_names[o]))
+				options.order = o;
+		if (options.order == ORDERS)
+			return ERR_BADARG;
+		break;
+	case 'b':
+		if (!strcmp(arg, "auto")) {
+			options.bgcolor = PF_AUTO_BGCOLOR;
+			break;
+		}
+		options.bgcolor = strtoul(arg, NULL, 16);
+		if (options.bgcolor > 0x00ffffff)
+			return ERR_BADARG;
+		break;
+	case 'P':
+		options.prefilled = true;
+		break;
+	case 'c':
+		options.connections = atoi(arg);
+		if (options.connections <= 0)
+			return ERR_BADARG;
+		break;
+	case 'C':
+		if (strchr(arg, ':') == NULL)
+			return ERR_BADARG;
+		options.pool_min = atoi(arg);
+		options.pool_max = atoi(strchr(arg, ':') + 1);
+		if (options.pool_min <= 0 || options.pool_max < options.pool_min)
+			return ERR_BADARG;
+		break;
+	case 'R':
+		options.rate_cap = strtod(arg, NULL);
+		if (options.rate_cap <= 0)
+			return ERR_BADARG;
+		break;
+	case 'F':
+		options.calm = true;
+		break;
+	case 'G':
+		options.colors = arg;
+		if (pf_colors(options.colors))
+			return ERR_BADARG;
+		break;
+	case 'T':
+		options.threshold = atoi(arg);
+		if (options.threshold < 0 || options.threshold > PF_THRESHOLD_MAX)
+			return ERR_BADARG;
+		break;
+	case 'V':
+		options.verify_rate = atoi(arg);
+		if (options.verify_rate <= 0)
+			return ERR_BADARG;
+		break;
+	case 'l':
+		options.latency_target = atoi(arg);
+		if (options.latency_target <= 0)
+			return ERR_BADARG;
+		break;
+	case 'r':
+		options.spread = true;
+		break;
+	case 's':
+		options.sndbuf_shift++;
+		break;
+	case 'u':
+		options.udp = true;
+		break;
+	case 'g':
+		options.udp = true;
+		options.gso = true;
+		break;
+	case 'x':
+		options.upscale = atoi(arg);
+		if (options.upscale <= 0 || options.upscale > PF_UPSCALE_MAX)
+			return ERR_BADARG;
+		break;
+	case 'z':
+		options.zerocopy = atoi(arg);
+		if (options.zerocopy <= 0)
+			return ERR_BADARG;
+		break;
+	case 'w':
+		options.connect_timeout = atoi(arg);
+		if (options.connect_timeout <= 0)
+			return ERR_BADARG;
+		break;
+	case 'm':
+		options.metrics_addr = arg;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+void options_usage(bool frames)
+{
+	fprintf(stderr,
+		"  -a			use async i/o\n"
+		"  -c CONNECTIONS	size of pixelflut connection pool (default %d)\n"
+		"  -C MIN:MAX		grow and shrink the pool within these bounds as throughput allows\n"
+		"  -r			spread the pool across all addresses of HOST\n"
+		"  -u			send over UDP instead of TCP\n"
+		"  -g			with -u, let the kernel cut datagrams (the server must ignore blank lines)\n"
+		"  -z BYTES		send buffers of at least BYTES without copying them (MSG_ZEROCOPY)\n"
+		"  -s			increase SO_SNDBUF socket buffers by 2x (can pass multiple times)\n"
+		"  -w MS			connection timeout in milliseconds (default %d)\n"
+		"  -A MODE		spread pixels over the pool as pixels (round-robin, default), tiles or bands\n"
+		"  -O ORDER		send rects in interleave (default), multires, hilbert or noise order\n"
+		"  -R HZ			refresh areas that change faster than this only HZ times a second\n"
+		"  -T N			let pixels off that changed by less than N per channel, until it's quiet\n"
+		"  -F			hold flickering pixels still until they settle\n"
+		"  -G SPEC		transform colors by gamma=G,brightness=B,contrast=C,levels=N,\n"
+		"			palette=N,dither=D\n"
+		"  -x N			show every pixel as an NxN block, diffed at its own size\n"
+		"  -V RATE		read back RATE pixels a second and repaint what others painted over\n"
+		"  -m ADDR		serve Prometheus metrics on [HOST:]PORT or unix:PATH\n"
+		"",
+		DEFAULT_CONNECTIONS,
+		DEFAULT_CONNECT_TIMEOUT
+	);
+	if (!frames)
+		return;
+
+	fprintf(stderr,
+		"  -b RRGGBB		occasionally blit every pixel except this one, or auto to find it\n"
+		"  -P			assume the canvas is filled with the -b color already\n"
+		"  -l MS			skip frames while the pending damage would take longer than this to send\n"
+		""
+	);
+}
+
+int options_connect(char *host, int port, int connections)
+{
+	/* the pool starts out within the bounds of -C */
+	if (options.pool_max && connections < options.pool_min)
+		connections = options.pool_min;
+	if (options.pool_max && connections > options.pool_max)
+		connections = options.pool_max;
+
+	if (options.udp)
+		pf_udp(options.gso);
+
+	int err = pf_connect(connections, host, port, options.connect_timeout, options.spread);
+	if (err)
+		return err;
+
+	if (options.pool_max) {
+		err = pf_autoscale(options.pool_min, options.pool_max);
+		if (err)
+			return err;
+	}
+
+	if (options.verify_rate)
+		pf_verify(options.verify_rate);
+
+	if (options.zerocopy)
+		pf_zerocopy(options.zerocopy);
+
+	if (options.asyncio) {
+		err = pf_asyncio();
+		if (err)
+			return err;
+	}
+
+	if (options.sndbuf_shift) {
+		err = pf_increase_sndbuf(options.sndbuf_shift);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int options_configure(double rate_cap)
+{
+	pf_assign(options.assign);
+	pf_order(options.order);
+	pf_rate_cap(rate_cap);
+	pf_latency_target(options.latency_target);
+	pf_threshold(options.threshold);
+	pf_calm(options.calm);
+	pf_prefilled(options.prefilled);
+	pf_upscale(options.upscale);
+	if (options.colors)
+		return pf_colors(options.colors);
+	return 0;
+}
+
+int options_setup(const struct shard_config *server)
+{
+	int err = options_connect(server->host, server->port, server->connections);
+	if (err)
+		return err;
+
+	err = options_configure(server->rate_cap);
+	if (err)
+		return err;
+
+	pf_offset(server->offset_x, server->offset_y);
+	return pf_canvas(server->width, server->height);
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
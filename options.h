@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>	/* bool */
+#include <stdint.h>	/* uint32_t */
+
+#include "order.h"	/* enum order */
+#include "pixelflut.h"	/* enum pf_assign */
+#include "shard.h"	/* struct shard_config */
+
+#define DEFAULT_CONNECTIONS	8
+#define DEFAULT_CONNECT_TIMEOUT	3000	/* ms */
+
+/*
+ * getopt letters of the options every binary takes, which set up and pace
+ * the pixelflut connection pool, and of those only binaries producing frames
+ * take, which decide what goes into them
+ */
+#define OPTIONS_POOL	"aA:c:C:FgG:m:O:rR:sT:uV:w:x:z:"
+#define OPTIONS_FRAMES	"b:l:P"
+
+/*
+ * struct options are the pixelflut settings, the same for every server, as
+ * options_parse reads them from the command line
+ */
+struct options {
+	int connections;
+	int connect_timeout;	/* ms */
+	bool spread;
+	int pool_min, pool_max;	/* see pf_autoscale, or 0 */
+	int sndbuf_shift;
+	bool asyncio;
+	bool udp;
+	bool gso;
+	int zerocopy;		/* bytes, see pf_zerocopy, or 0 */
+	enum pf_assign assign;
+	enum order order;
+	double rate_cap;	/* Hz, see pf_rate_cap, or 0 */
+	int threshold;
+	bool calm;
+	int verify_rate;	/* pixels a second, or 0 */
+	char *colors;		/* see pf_colors, or NULL */
+	int upscale;
+	char *metrics_addr;	/* or NULL */
+
+	/* OPTIONS_FRAMES */
+	uint32_t bgcolor;	/* see pf_send */
+	bool prefilled;
+	int latency_target;	/* ms, or 0 */
+};
+
+extern struct options options;
+
+/*
+ * options_parse reads option opt, as returned by getopt, and its argument arg
+ * into options. Returns 0 on success, ERR_BADARG if arg is invalid, or -1 if
+ * opt is none of OPTIONS_POOL and OPTIONS_FRAMES, for the caller to handle.
+ */
+int options_parse(int opt, char *arg);
+
+/*
+ * options_usage prints the usage info of OPTIONS_POOL to stderr, and of
+ * OPTIONS_FRAMES if frames is true.
+ */
+void options_usage(bool frames);
+
+/*
+ * options_connect connects the pixelflut state of the calling thread to host
+ * and port with a pool of connections, kept within -C, and sets the pool up.
+ * Returns 0 on success.
+ */
+int options_connect(char *host, int port, int connections);
+
+/*
+ * options_configure applies the settings that don't depend on the server,
+ * capping the refresh rate to rate_cap. Call before pf_canvas. Returns 0 on
+ * success.
+ */
+int options_configure(double rate_cap);
+
+/*
+ * options_setup connects the pixelflut state of the calling thread to server
+ * and applies the settings, as shard_start's setup. Returns 0 on success.
+ */
+int options_setup(const struct shard_config *server);
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
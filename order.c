@@ -0,0 +1,202 @@
+#include <stdbool.h>	/* bool */
+#include <stdio.h>	/* perror */
+#include <stdlib.h>	/* malloc, qsort */
+
+#include "order.h"
+
+/* ORDER_INTERLEAVE */
+#define ROUNDS 5
+#define STAGGER 2
+
+/* ORDER_MULTIRES: the coarsest pass sends one pixel per 2^MULTIRES_LEVELS block */
+#define MULTIRES_LEVELS 3
+
+/* tables of this many rect sizes are kept */
+#define ORDER_CACHE 16
+
+/* R2 sequence, the 2D generalization of the golden ratio */
+#define R2_A1 0.7548776662466927
+#define R2_A2 0.5698402909980532
+
+struct order_table {
+	enum order order;
+	int w;
+	int h;
+	uint64_t used;
+	uint32_t *table;
+};
+
+const char * const order_names[ORDERS] = {
+	[ORDER_INTERLEAVE] = "interleave",
+	[ORDER_MULTIRES] = "multires",
+	[ORDER_HILBERT] = "hilbert",
+	[ORDER_NOISE] = "noise",
+};
+
+/* per thread, so each pixelflut pool has its own */
+static __thread struct order_table cache[ORDER_CACHE];
+static __thread uint64_t ticks;
+
+static uint32_t pack(int x, int y)
+{
+	return (uint32_t) y << 16 | x;
+}
+
+/* order_interleave staggers rows in rounds so pixels all over the rect are blitted ASAP */
+static void order_interleave(uint32_t *table, int w, int h)
+{
+	int n = 0;
+	for (int round = 0; round < ROUNDS; round++) {
+		for (int y = 0; y < h; y++) {
+			int row_round = (round + y) % ROUNDS;
+			int row_bias = (row_round * STAGGER) % ROUNDS;
+			for (int x = row_bias; x < w; x += ROUNDS)
+				table[n++] = pack(x, y);
+		}
+	}
+}
+
+/*
+ * order_multires sends one pixel of every 8x8 block first, then the pixels
+ * that complete a 4x4 grid, then 2x2, then the rest, so a coarse preview of
+ * the whole rect shows up after 1/64 of the pixels.
+ */
+static void order_multires(uint32_t *table, int w, int h)
+{
+	int n = 0;
+	for (int level = MULTIRES_LEVELS; level >= 0; level--) {
+		const int step = 1 << level;
+		for (int y = 0; y < h; y += step) {
+			for (int x = 0; x < w; x += step) {
+				/* the coarsest level a pixel belongs to */
+				int tz = __builtin_ctz((unsigned) (x | y) | 1 << MULTIRES_LEVELS);
+				if (tz == level)
+					table[n++] = pack(x, y);
+			}
+		}
+	}
+}
+
+/* hilbert_index returns the distance of (x, y) along a Hilbert curve filling an n x n square */
+static uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y)
+{
+	uint64_t d = 0;
+	for (uint32_t s = n / 2; s > 0; s /= 2) {
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += (uint64_t) s * s * ((3 * rx) ^ ry);
+
+		/* rotate the quadrant */
+		if (!ry) {
+			if (rx) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			uint32_t t = x;
+			x = y;
+			y = t;
+		}
+	}
+	return d;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+	uint64_t ka = *(const uint64_t *) a, kb = *(const uint64_t *) b;
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+ * order_sorted sorts the pixels of the rect by a key, either their position
+ * along a Hilbert curve, or their rank in the R2 sequence. Ranking by R2
+ * spreads consecutive pixels evenly over the rect without clumping, like blue
+ * noise. Returns false if out of memory.
+ */
+static bool order_sorted(uint32_t *table, int w, int h, enum order o)
+{
+	uint64_t *keys = malloc((size_t) w * h * sizeof(*keys));
+	if (keys == NULL)
+		return false;
+
+	uint32_t n = 1;
+	while (n < (uint32_t) w || n < (uint32_t) h)
+		n *= 2;
+
+	for (int y = 0, k = 0; y < h; y++) {
+		for (int x = 0; x < w; x++, k++) {
+			uint64_t key;
+			if (o == ORDER_HILBERT) {
+				/* fits in 32 bits, since rects are smaller than 65536 x 65536 */
+				key = hilbert_index(n, x, y);
+			} else {
+				double r = x * R2_A1 + y * R2_A2;
+				key = (uint64_t) ((r - (uint64_t) r) * 4294967296.0);
+			}
+			keys[k] = key << 32 | pack(x, y);
+		}
+	}
+
+	qsort(keys, (size_t) w * h, sizeof(*keys), compare_keys);
+
+	for (int k = 0; k < w * h; k++)
+		table[k] = keys[k];
+
+	free(keys);
+	return true;
+}
+
+const uint32_t *order_get(enum order o, int w, int h)
+{
+	struct order_table *lru = &cache[0];
+	for (int c = 0; c < ORDER_CACHE; c++) {
+		struct order_table *t = &cache[c];
+		if (t->table && t->order == o && t->w == w && t->h == h) {
+			t->used = ++ticks;
+			return t->table;
+		}
+		if (t->used < lru->used)
+			lru = t;
+	}
+
+	uint32_t *table = malloc((size_t) w * h * sizeof(*table));
+	if (table == NULL) {
+		perror("couldn't allocate send order");
+		return NULL;
+	}
+
+	switch (o) {
+	case ORDER_MULTIRES:
+		order_multires(table, w, h);
+		break;
+	case ORDER_HILBERT:
+	case ORDER_NOISE:
+		if (!order_sorted(table, w, h, o)) {
+			perror("couldn't allocate send order");
+			free(table);
+			return NULL;
+		}
+		break;
+	default:
+		order_interleave(table, w, h);
+		break;
+	}
+
+	free(lru->table);
+	lru->order = o;
+	lru->w = w;
+	lru->h = h;
+	lru->used = ++ticks;
+	lru->table = table;
+	return table;
+}
+
+void order_free(void)
+{
+	for (int c = 0; c < ORDER_CACHE; c++) {
+		free(cache[c].table);
+		cache[c].table = NULL;
+		cache[c].used = 0;
+	}
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>	/* uint32_t */
+
+/* orders in which the pixels of a rect can be sent */
+enum order {
+	ORDER_INTERLEAVE,	/* rows in staggered rounds of every 5th pixel */
+	ORDER_MULTIRES,		/* one pixel per 8x8 block, then 4x4, 2x2, the rest */
+	ORDER_HILBERT,		/* along a Hilbert curve */
+	ORDER_NOISE,		/* blue noise, ranked by the R2 sequence */
+	ORDERS
+};
+
+extern const char * const order_names[ORDERS];
+
+/*
+ * order_get returns the pixels of a w x h rect in order o, as (y << 16 | x)
+ * relative to the top-left corner of the rect. Tables are cached per thread for
+ * the most recently used rect sizes and stay valid until the thread calls
+ * order_get again. Returns NULL if the table couldn't be allocated.
+ */
+const uint32_t *order_get(enum order o, int w, int h);
+
+/* order_free drops the cached tables of the thread. Redundant calls are safe. */
+void order_free(void);
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
@@ -1,121 +1,740 @@
-#include <fcntl.h>	/* fcntl */
-#include <netdb.h>	/* gethostbyname */
+#define _GNU_SOURCE		/* sendmmsg, memrchr */
+
+#include <errno.h>	/* errno, EAGAIN */
+#include <fcntl.h>	/* fcntl, open */
+#include <limits.h>	/* INT_MAX */
+#include <math.h>	/* cbrt, pow, round */
+#include <linux/errqueue.h>	/* sock_extended_err, SO_EE_* */
+#include <linux/futex.h>	/* FUTEX_WAKE */
+#include <linux/sockios.h>	/* SIOCOUTQ */
+#include <netdb.h>	/* getaddrinfo */
+#include <netinet/in.h>	/* IPPROTO_TCP */
+#include <netinet/tcp.h>	/* TCP_INFO */
+#include <netinet/udp.h>	/* UDP_SEGMENT */
+#include <poll.h>	/* poll */
+#include <pthread.h>	/* pthread_mutex_* */
 #include <stdbool.h>	/* bool, true, false */
-#include <stdio.h>	/* perror, dprintf */
-#include <stdlib.h>	/* calloc */
-#include <string.h>	/* memset */
-#include <sys/socket.h> /* socket, getsockopt, setsockopt */
+#include <stdio.h>	/* perror, dprintf, snprintf, sscanf */
+#include <stdlib.h>	/* abs, calloc, free, malloc */
+#include <string.h>	/* memcpy, memrchr, memset, strcmp, strncmp, strtok_r */
+#include <sys/ioctl.h>	/* ioctl */
+#include <sys/mman.h>	/* mmap, munmap */
+#include <sys/socket.h> /* socket, getsockopt, setsockopt, sendmmsg, MSG_ZEROCOPY */
+#include <sys/syscall.h>	/* SYS_futex */
+#include <sys/un.h>	/* sockaddr_un */
 #include <time.h>	/* clock_gettime */
-#include <unistd.h>	/* read */
+#include <unistd.h>	/* ftruncate, read, syscall, write */
 
 #include "error.h"	/* ERR_* */
+#include "lz.h"		/* lz_compress, LZ_BOUND */
+#include "order.h"	/* order_* */
+#include "stats.h"	/* stats_* */
+#include "trace.h"	/* trace_rect_* */
 
 #include "pixelflut.h"
 
-#define ROUNDS 5
-#define STAGGER 2
 #define REBLIT_FREQUENCY 23	/* should be prime and far from 2^n */
 
-/* performance test */
-#define PT_TRIALS 5
-extern bool pt_active;
-struct timespec pt_running, pt_trials[PT_TRIALS];
-int pt_trial;
+/* per-connection output buffer; flushed when full and after every rect */
+#define OUTBUF_LEN 65536
+#define PX_MAXLEN 32	/* "PX 2147483647 2147483647 rrggbb\n" */
+#define PX_MINLEN 14	/* "PX 0 0 rrggbb\n" */
+#define OUTBUF_PIXELS (OUTBUF_LEN / PX_MINLEN + 1)
 
-static int *conns;
-static int active_conn_i;
-static int num_conns;
+/* blocks for a relay: pixels per block, and their packed size at most */
+#define RELAY_PIXELS 2048
+#define RELAY_PX_MAXLEN 8	/* 5 bytes of varint and 3 of color */
+#define RELAY_BLOCK_MAX (sizeof(struct pf_relay_block) + LZ_BOUND(RELAY_PIXELS * RELAY_PX_MAXLEN))
 
-int pf_increase_sndbuf(int factor)
+/* output buffers per connection the kernel may hold on to with MSG_ZEROCOPY */
+#define ZEROCOPY_BUFS 16
+
+/*
+ * pixels recently flushed per connection. If the connection drops, these may
+ * still have been sitting in the kernel's send buffer, so they are replayed.
+ */
+#define REPLAY_PIXELS 16384
+
+/* UDP transport */
+#define UDP_BATCH 64		/* datagrams per sendmmsg, and segments per GSO send */
+#define UDP_PAYLOAD 1472	/* bytes per datagram when the path MTU is unknown */
+#define UDP_MAX 65507		/* bytes in the largest datagram */
+
+/* reconnect backoff */
+#define BACKOFF_MIN 100		/* ms */
+#define BACKOFF_MAX 10000	/* ms */
+
+/* a connection that can't take a single byte for this long is dead */
+#define SEND_STALL_TIMEOUT 10000	/* ms */
+
+/*
+ * shadow canvas values that can't be colors. DIRTY pixels are queued for
+ * replay; UNKNOWN pixels aren't, but will be sent as soon as they're damaged.
+ * LOST pixels were replayed and are like UNKNOWN ones, except that they can't
+ * be assumed to show a prefilled background.
+ */
+#define SHADOW_DIRTY	0xff000000
+#define SHADOW_UNKNOWN	0xfe000000
+#define SHADOW_LOST	0xfd000000
+
+enum pf_conn_state {
+	CONN_UP,
+	CONN_CONNECTING,
+	CONN_DOWN,
+};
+
+/*
+ * struct pf_outbuf is an output buffer of a connection. Buffers sent with
+ * MSG_ZEROCOPY are held by the kernel until it reports them released on the
+ * socket error queue, identified by a counter of such sends per socket.
+ */
+struct pf_outbuf {
+	char *data;		/* OUTBUF_LEN bytes, mapped separately */
+	uint32_t first;		/* id of the first send still held */
+	uint32_t end;		/* id after the last send */
+	int held;		/* sends the kernel hasn't released yet */
+};
+
+struct pf_conn {
+	int fd;
+	int state;		/* enum pf_conn_state, read by the metrics thread */
+	int len;		/* bytes buffered, likewise */
+	uint64_t bytes;		/* bytes accepted by the socket, likewise */
+	int payload;		/* bytes per datagram, over UDP */
+
+	/* autoscaling */
+	uint64_t stalls;	/* times a write hit a full send buffer */
+	uint64_t ctl_bytes;	/* bytes at the last control interval */
+	uint64_t ctl_stalls;	/* stalls at the last control interval */
+
+	/* tile affinity */
+	uint64_t load;		/* work of the tiles it owns or is taking over */
+	uint64_t acked;		/* stream offset acknowledged by the server */
+
+	/* reconnection */
+	int backoff;		/* ms */
+	int64_t retry_at;	/* ms, while CONN_DOWN */
+	int64_t connect_start;	/* ms, while CONN_CONNECTING */
+	int candidate;		/* attempts made, while CONN_CONNECTING */
+
+	/* pixel indices encoded into buf */
+	int num_buffered;
+	uint32_t buffered[OUTBUF_PIXELS];
+
+	/* ring of pixel indices recently flushed */
+	int flushed_head;
+	int num_flushed;
+	uint32_t flushed[REPLAY_PIXELS];
+
+	/* commands are encoded into buf, which is out[cur].data */
+	char *buf;
+	int cur;
+	struct pf_outbuf out[ZEROCOPY_BUFS];
+
+	/* MSG_ZEROCOPY */
+	bool zerocopy;		/* the socket takes it */
+	uint32_t zc_next;	/* id of the next send with it */
+	int zc_held;		/* sends held, over all buffers */
+};
+
+/* how long to wait for one address before racing the next one, per RFC 8305 */
+#define CONNECT_ATTEMPT_DELAY 250	/* ms */
+
+struct pf_candidate {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+/* pool autoscaling */
+#define CONTROL_INTERVAL 1000	/* ms */
+#define CONTROL_GAIN 0.05	/* relative goodput change that counts as better or worse */
+#define CONTROL_IDLE 5		/* intervals without stalls before shrinking */
+#define SNDBUF_MAX (16 * 1024 * 1024)
+
+/* pending damage */
+#define DIRTY_SHIFT 5		/* 32x32 px */
+#define DIRTY_AREA (1 << 2 * DIRTY_SHIFT)
+#define SEND_SLICE 16384	/* pixels diffed per pf_send */
+#define DRR_QUANTUM 64		/* pixels a tile may send per turn, deficit round-robin */
+#define RATE_WEIGHT 0.25	/* of the latest interval in the average time between damage */
+#define RATE_COLD 1000		/* ms, average time between damage of a tile seen first */
+#define BUCKETS 8		/* priority levels of dirty tiles */
+#define RECENT_MS 64		/* damage younger than this is as fresh as it gets */
+#define CONVERGE_QUIET 500	/* ms without damage before approximate tiles are made exact */
+#define CALM_TOGGLES 3		/* times a pixel reverts in a row before it's held */
+
+/* background detection */
+#define BG_CANDIDATES 8		/* colors counted at once */
+#define BG_SAMPLES 64		/* pixels sampled per pf_send */
+#define BG_WINDOW 4096		/* samples per decision */
+#define BG_SHARE 4		/* 1/n of the samples the background needs at least */
+#define BG_STRIDE 7919		/* prime, so samples spread over the whole canvas */
+#define DIFF_LANES 4		/* pixels compared at once */
+#define BACKLOG_WINDOW 16	/* ms over which send rates are sampled */
+#define BACKLOG_WEIGHT 0.25	/* of the latest sample in the average send rates */
+
+/* read-back verification */
+#define VERIFY_CONNS 2		/* dedicated connections for reads */
+#define VERIFY_WINDOW 512	/* reads in flight per connection */
+#define VERIFY_SETTLE 250	/* ms for a sent pixel to land, on top of the backlog */
+#define VERIFY_HOT 16		/* tiles found painted over lately, sampled closely */
+#define VERIFY_INTERVAL 20	/* ms between reads while there's nothing to send */
+#define VERIFY_INLEN 4096
+
+enum pf_dirty_state {
+	DIRTY_CLEAN,
+	DIRTY_QUEUED,
+	DIRTY_AGAIN,		/* damaged again after its cursor moved */
+	DIRTY_CONVERGE,		/* sending exact colors where near ones were let off */
+};
+
+struct pf_dirty {
+	uint16_t cursor;	/* position in the send order of the tile */
+	uint8_t state;		/* enum pf_dirty_state */
+	bool inexact;		/* pixels were let off for being near their color */
+	int deficit;		/* pixels it may still send before its turn is over */
+	float interval;		/* ms between damage, moving average */
+	int64_t damaged_at;	/* ms */
+	int64_t walk_at;	/* ms, when the cursor last left 0 */
+	int64_t sent_at;	/* ms, when pixels of it were last sent */
+	bool overwritten;	/* another client painted over it; repaint first */
+};
+
+/* DIFF_LANES pixels, or their channels */
+typedef uint32_t pf_lanes __attribute__((vector_size(DIFF_LANES * 4)));
+typedef int8_t pf_lane_bytes __attribute__((vector_size(DIFF_LANES * 4)));
+typedef uint8_t pf_lane_ubytes __attribute__((vector_size(DIFF_LANES * 4)));
+
+/* tile affinity */
+#define TILE_SHIFT 5		/* 32x32 px */
+#define BAND_SHIFT 3		/* 8 rows */
+#define TILE_IMBALANCE 8	/* 1/n of the average load that is tolerated between connections */
+
+struct pf_tile {
+	int owner;		/* index into conns, or -1 if never sent */
+	int next;		/* connection taking over once mark is acknowledged, or -1 */
+	uint64_t mark;		/* stream offset on owner just past the tile's last pixel */
+	uint32_t work;		/* pixels sent lately, halved every CONTROL_INTERVAL */
+};
+
+struct pf_probe {
+	int fd;			/* or -1 while down */
+	bool connecting;
+	int backoff;		/* ms */
+	int64_t retry_at;	/* ms, while down */
+	int64_t connect_start;	/* ms, while connecting */
+	int candidate;		/* tried next, the one that worked last */
+
+	/* reads in flight, oldest first */
+	int head;
+	int len;
+	uint32_t asked[VERIFY_WINDOW];
+	int64_t asked_at[VERIFY_WINDOW];	/* ms */
+
+	int out_len;
+	char out[VERIFY_WINDOW * PX_MAXLEN];
+	int in_len;
+	char in[VERIFY_INLEN];
+};
+
+const char * const pf_assign_names[PF_ASSIGNS] = {
+	[PF_ASSIGN_PIXELS] = "pixels",
+	[PF_ASSIGN_TILES] = "tiles",
+	[PF_ASSIGN_BANDS] = "bands",
+};
+
+/*
+ * the pixelflut state is per thread, so each thread that calls pf_connect
+ * drives a pool and canvas of its own
+ */
+static __thread struct pf_conn *conns;
+static __thread int active_conn_i;
+static __thread int num_conns;	/* read by the metrics thread */
+static __thread int pool_min;
+static __thread int pool_max;
+static __thread int pool_slots;	/* size of the conns table */
+static __thread bool autoscale;
+
+/* socket options for connections opened later on */
+static __thread int sndbuf_factor;
+static __thread bool asyncio;
+
+/* datagrams instead of streams, and whether the kernel segments them */
+static __thread bool udp;
+static __thread bool udp_gso;
+
+/* buffers at least this long are sent with MSG_ZEROCOPY, or 0 */
+static __thread int zerocopy_min;
+
+/* a canvas shared with a server on this machine, instead of the pool */
+static __thread int shm_fd = -1;
+static __thread struct pf_shm *shm;
+static __thread size_t shm_len;
+
+/* the pool is one connection to kernelflut-relay */
+static __thread bool relay;
+
+/* autoscaling controller */
+static __thread struct {
+	int64_t last;		/* ms */
+	double goodput;		/* bytes per second during the previous interval */
+	int direction;		/* +1 when the pool grew last, -1 when it shrank */
+	int idle;		/* intervals in a row without stalls */
+} ctl;
+
+/* resolved server addresses, in the order they should be tried */
+static __thread struct pf_candidate *candidates;
+static __thread int num_candidates;
+static __thread int connect_timeout;	/* ms */
+static __thread bool spread_pool;
+
+static __thread enum order send_order;
+
+/* tile affinity */
+static __thread enum pf_assign assign_mode;
+static __thread struct pf_tile *tiles;
+static __thread int num_tiles;
+static __thread int tile_shift_x, tile_shift_y, tiles_x;
+static __thread int64_t tiles_last;	/* ms */
+
+/* pixel indices that survived the diff stage of the current slice */
+static __thread uint32_t *changed;
+
+static __thread int canvas_w, canvas_h;
+
+/* where the canvas starts on the server */
+static __thread int offset_x, offset_y;
+
+/*
+ * upscaling: each pixel of the canvas is a block of upscale x upscale pixels
+ * on the server. Its commands are put together from the starts of their
+ * lines, "PX x " per column of the server and "y " per row, made once.
+ */
+struct block_coord {
+	uint8_t len;
+	char s[15];
+};
+static __thread int upscale = 1;
+static __thread struct block_coord *block_x, *block_y;
+
+/*
+ * color transform, applied wherever a pixel is read from the framebuffer: a
+ * table per channel, of values already shifted into place
+ */
+static __thread bool transform;
+static __thread uint32_t lut[3][256];
+
+/* colors a palette has at most */
+#define PALETTE_MAX 256
+/* palette colors compared at once */
+#define PALETTE_LANES 8
+/* pixels of the first frame a palette is picked from, at most */
+#define PALETTE_SAMPLES 16384
+/* bits per channel of the inverse table */
+#define INVERSE_BITS 5
+/* inverse table entry not looked up yet */
+#define INVERSE_UNKNOWN UINT32_MAX
+/* look_up position of colors that aren't on the canvas */
+#define NOWHERE UINT32_MAX
+
+typedef int32_t pf_palette_lanes __attribute__((vector_size(PALETTE_LANES * 4)));
+
+/*
+ * palette picked from the first frame, its channels apart for SIMD, and the
+ * nearest of its colors to every cell of a coarse RGB cube, as looked up
+ */
+struct palette {
+	int want, size;
+	int32_t r[PALETTE_MAX], g[PALETTE_MAX], b[PALETTE_MAX];
+	uint32_t color[PALETTE_MAX];
+	uint32_t inverse[1 << (3 * INVERSE_BITS)];
+};
+
+/*
+ * quantization after the tables, where it can't be folded into them: to the
+ * palette, or to levels per channel once a dither offset for the position on
+ * the canvas is added
+ */
+static __thread bool quantize, dithering;
+static __thread struct palette *palette;
+static __thread uint8_t quantum[256];
+static __thread int dither[4][4];
+
+/*
+ * shadow canvas: what pixelflut should be showing for each pixel, as
+ * 0x00RRGGBB, or one of the SHADOW_* values
+ */
+static __thread uint32_t *shadow;
+
+/* pixels to resend because their connection dropped; all are SHADOW_DIRTY */
+static __thread uint32_t *replay;
+static __thread int num_replay;
+
+/*
+ * pending damage: dirty tiles waiting to be diffed against the shadow canvas,
+ * in priority buckets. Each goes around its queue in passes until its cursor
+ * has walked its whole send order.
+ */
+struct pf_bucket {
+	uint32_t *ring;		/* indices into dirty */
+	int head;
+	int len;
+};
+
+static __thread struct pf_dirty *dirty;
+static __thread struct pf_bucket buckets[BUCKETS];
+static __thread int num_queued;
+static __thread uint32_t turn;
+static __thread int dirty_x;		/* tiles per row */
+static __thread int num_dirty;
+
+/* dirty tiles waiting because they're over their rate cap */
+static __thread uint32_t *parked;
+static __thread int num_parked;
+static __thread double rate_cap;		/* Hz, or 0 */
+
+/* pixels closer than this to their color in every channel count as unchanged */
+static __thread int threshold;
+
+/*
+ * calm mode: what pixelflut showed at each pixel before its shadow value, and
+ * how many times in a row it was sent just to revert to that
+ */
+static __thread bool calm;
+static __thread uint32_t *previous;
+static __thread uint8_t *toggles;
+
+/* the most common colors sampled lately, Misra-Gries style, and the winner */
+static __thread struct {
+	uint32_t color[BG_CANDIDATES];
+	int count[BG_CANDIDATES];
+	uint32_t position;
+	int samples;
+	uint32_t found;
+} bg = { .found = PF_NO_BGCOLOR };
+static __thread bool prefilled;
+
+/* pointer position on the canvas, or -1 */
+static __thread int cursor_x = -1;
+static __thread int cursor_y = -1;
+
+/* overload: how fast pending damage goes out, and what that means for latency */
+static __thread struct {
+	int64_t since;		/* ms, start of the current sample, or 0 */
+	int64_t pixels;		/* walked by dirty tile cursors during the sample */
+	uint64_t accepted;	/* bytes taken by the sockets, at the start of the sample */
+	uint64_t acked;		/* bytes acknowledged by the server, likewise */
+	int unsent;		/* bytes in the socket send queues, likewise */
+	double bytes_per_px;	/* per pixel walked, moving average */
+	double ack_rate;	/* bytes per ms, moving average */
+} rates;
+static __thread int backlog_ms;		/* read by the metrics thread */
+static __thread int latency_target;	/* ms, or 0 */
+static __thread bool overloaded;
+
+/*
+ * read-back verification: connections asking pixelflut what it shows, how
+ * many reads a second they may ask, and the tiles to ask about most
+ */
+static __thread struct pf_probe probes[VERIFY_CONNS];
+static __thread int verify_rate;		/* Hz, or 0 */
+static __thread double verify_budget;	/* reads that may be asked right now */
+static __thread int64_t verify_last;	/* ms */
+static __thread uint32_t verify_seed = 1;
+static __thread uint32_t hot[VERIFY_HOT];
+static __thread int num_hot;
+
+/* what the metrics thread reads of the state of each thread with a pool */
+struct pf_view {
+	struct pf_conn **conns;
+	int *num_conns;
+	int *backlog_ms;
+	struct pf_view *next;
+	bool registered;
+};
+
+static pthread_mutex_t views_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pf_view *views;
+static __thread struct pf_view view;
+
+/*
+ * set_sndbuf sets the send buffer of fd to bytes, which the kernel doubles for
+ * bookkeeping. Returns 0 on success.
+ */
+static int set_sndbuf(int fd, int bytes)
 {
-	for (int i = 0; i < num_conns; i++) {
-		int sndbuf;
-		socklen_t optlen = sizeof(sndbuf);
-		int err = getsockopt(conns[i], SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen);
-		if (err)
-			return err;
+	int half = bytes / 2;
+	if (!setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &half, sizeof(half)))
+		return 0;
 
-		fprintf(stderr, "DEBUG: socket buffer size was %d, now it's %d\n", sndbuf, sndbuf << factor);
+	/* not privileged, so stay within net.core.wmem_max */
+	return setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &half, sizeof(half));
+}
 
-		/* value is already doubled once on write */
-		sndbuf <<= factor - 1;
+static int get_sndbuf(int fd)
+{
+	int sndbuf;
+	socklen_t optlen = sizeof(sndbuf);
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen))
+		return 0;
+	return sndbuf;
+}
 
-		err = setsockopt(conns[i], SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf, optlen);
-		if (err)
-			return err;
+static int set_async(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (fcntl(fd, F_SETFL, flags | O_ASYNC) == -1) {
+		perror("fcntl couldn't set O_ASYNC");
+		return ERR_IRRECOVERABLE;
 	}
 	return 0;
 }
 
-int pf_asyncio(void)
+/*
+ * udp_payload returns how many bytes fit in a datagram on fd without
+ * fragmenting it, going by the MTU of the route to the server.
+ */
+static int udp_payload(int fd)
 {
-	for (int i = 0; i < num_conns; i++) {
-		int flags = fcntl(conns[i], F_GETFL);
-		int err = fcntl(conns[i], F_SETFL, flags | O_ASYNC);
-		if (err == -1) {
-			perror("fcntl couldn't set O_ASYNC");
-			return ERR_IRRECOVERABLE;
-		}
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	int mtu, payload = UDP_PAYLOAD;
+	socklen_t optlen = sizeof(mtu);
+	if (getsockname(fd, (struct sockaddr *) &addr, &addrlen))
+		return payload;
+
+	if (addr.ss_family == AF_INET6 && !getsockopt(fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &optlen))
+		payload = mtu - 40 - 8;
+	else if (addr.ss_family == AF_INET && !getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &optlen))
+		payload = mtu - 20 - 8;
+	return payload < UDP_MAX ? payload : UDP_MAX;
+}
+
+/*
+ * out_map maps an output buffer of its own, so it has whole pages the kernel
+ * can pin, and can be replaced without touching the pages the kernel holds.
+ * Maps it over the old one, if any. Returns 0 on success.
+ */
+static int out_map(struct pf_outbuf *o)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | (o->data ? MAP_FIXED : 0);
+	void *data = mmap(o->data, OUTBUF_LEN, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (data == MAP_FAILED)
+		return ERR_ALLOC;
+
+	o->data = data;
+	o->held = 0;
+	return 0;
+}
+
+/* conn_init gives a fresh connection slot its first output buffer */
+static int conn_init(struct pf_conn *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+	c->backoff = BACKOFF_MIN;
+	if (out_map(&c->out[0])) {
+		perror("couldn't allocate output buffer");
+		return ERR_ALLOC;
 	}
+	c->buf = c->out[0].data;
 	return 0;
 }
 
 /*
- * pf_connect1 opens a tcp socket to a running pixelflut server and connects.
- * Returns the fd if successful, otherwise returns a negative error; please
- * multiply this error by -1 before using it.
+ * out_forget drops every MSG_ZEROCOPY send of a closed connection. Buffers
+ * the kernel still holds are mapped anew, so whatever it sends from them on
+ * the way out isn't scribbled over.
  */
-static int pf_connect1(struct addrinfo *server)
+static void out_forget(struct pf_conn *c)
 {
-	int fd;
-	for (struct addrinfo *p = server; p; p = p->ai_next) {
+	for (int b = 0; b < ZEROCOPY_BUFS; b++)
+		if (c->out[b].held && out_map(&c->out[b]))
+			perror("couldn't replace output buffer");
+	c->zc_held = 0;
+	c->zc_next = 0;
+}
 
-		if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-			continue;
+/* out_hold notes a MSG_ZEROCOPY send from the current buffer of c */
+static void out_hold(struct pf_conn *c)
+{
+	struct pf_outbuf *o = &c->out[c->cur];
+	if (!o->held)
+		o->first = c->zc_next;
+	o->end = ++c->zc_next;
+	o->held++;
+	c->zc_held++;
+	STATS_ADD(zerocopy_sends, 1);
+}
 
-		if (connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
-			close(fd);
+/* out_release notes that the kernel is done with sends lo through hi of c */
+static void out_release(struct pf_conn *c, uint32_t lo, uint32_t hi)
+{
+	for (int b = 0; b < ZEROCOPY_BUFS; b++) {
+		struct pf_outbuf *o = &c->out[b];
+		if (!o->held)
 			continue;
+
+		/* ids wrap around */
+		uint32_t from = (int32_t) (lo - o->first) > 0 ? lo : o->first;
+		uint32_t to = (int32_t) (hi + 1 - o->end) < 0 ? hi + 1 : o->end;
+		if ((int32_t) (to - from) > 0) {
+			o->held -= to - from;
+			c->zc_held -= to - from;
 		}
+	}
+}
+
+/*
+ * zc_reap reads the notifications of MSG_ZEROCOPY sends on c from the socket
+ * error queue and releases what the kernel is done with. If the kernel had to
+ * copy the data anyway, as it does over loopback or to devices without
+ * scatter-gather, pinning only costs extra, so the connection stops asking
+ * for it. Returns how many notifications were read.
+ */
+static int zc_reap(struct pf_conn *c)
+{
+	int reaped = 0;
+	for (;;) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+		struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+		int n = recvmsg(c->fd, &msg, MSG_ERRQUEUE);
+		STATS_ADD(syscalls, 1);
+		if (n < 0)
+			return reaped;
+
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			const struct sock_extended_err *ee = (const void *) CMSG_DATA(cm);
+			if (cm->cmsg_len < CMSG_LEN(sizeof(*ee)) || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno)
+				continue;
 
-		return fd;
+			out_release(c, ee->ee_info, ee->ee_data);
+			reaped++;
+
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				STATS_ADD(zerocopy_copied, ee->ee_data - ee->ee_info + 1);
+				if (c->zerocopy)
+					fprintf(stderr, "DEBUG: connection %d copies anyway, sending without MSG_ZEROCOPY\n", (int) (c - conns));
+				c->zerocopy = false;
+			}
+		}
 	}
+}
 
-	perror("unable to open any socket");
-	return -ERR_PF_CONNECT;
+/* zc_setup asks for MSG_ZEROCOPY on the fresh socket of c, if it takes it */
+static void zc_setup(struct pf_conn *c)
+{
+	int one = 1;
+	c->zc_next = 0;
+	c->zerocopy = !setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
 }
 
 /*
- * read_until reads from fd until sep is reached, then replaces sep with a null
- * terminator. Returns true if sep was reached.
+ * conn_setup applies the socket options requested through pf_increase_sndbuf,
+ * pf_asyncio and pf_zerocopy to a socket that connected after they were
+ * requested.
  */
-static bool read_until(int fd, char sep, char *buf, int buf_len)
+static void conn_setup(struct pf_conn *c)
 {
-	for (int i = 0; i < buf_len; i++, buf++) {
-		int n = read(fd, buf, 1);
-		if (n != 1)
-			return false;
+	if (udp)
+		c->payload = udp_payload(c->fd);
 
-		if (*buf == sep) {
-			*buf = '\0';
-			return true;
-		}
+	if (zerocopy_min)
+		zc_setup(c);
+
+	if (sndbuf_factor)
+		set_sndbuf(c->fd, get_sndbuf(c->fd) << sndbuf_factor);
+
+	if (asyncio)
+		set_async(c->fd);
+}
+
+int pf_increase_sndbuf(int factor)
+{
+	for (int i = 0; i < num_conns; i++) {
+		int sndbuf = get_sndbuf(conns[i].fd);
+
+		fprintf(stderr, "DEBUG: socket buffer size was %d, now it's %d\n", sndbuf, sndbuf << factor);
+
+		int err = set_sndbuf(conns[i].fd, sndbuf << factor);
+		if (err)
+			return err;
 	}
 
-	return false;
+	sndbuf_factor = factor;
+	return 0;
 }
 
-int pf_connect(int pool_size, char *host, int port)
+int pf_asyncio(void)
 {
-	/* allocate memory for the file descriptor table */
-	num_conns = pool_size;
-	conns = calloc(num_conns, sizeof(*conns));
+	for (int i = 0; i < num_conns; i++) {
+		int err = set_async(conns[i].fd);
+		if (err)
+			return err;
+	}
+
+	asyncio = true;
+	return 0;
+}
+
+void pf_zerocopy(int min)
+{
+	if (udp) {
+		fprintf(stderr, "DEBUG: MSG_ZEROCOPY is only used over TCP\n");
+		return;
+	}
+
+	zerocopy_min = min;
+	for (int i = 0; i < num_conns; i++)
+		zc_setup(&conns[i]);
+
+	if (num_conns && !conns[0].zerocopy)
+		fprintf(stderr, "DEBUG: sockets don't take MSG_ZEROCOPY, copying instead\n");
+}
+
+/* pf_now_ms returns CLOCK_MONOTONIC in milliseconds */
+static int64_t pf_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / (1000 * 1000);
+}
+
+/*
+ * pf_resolve resolves host and port into the candidates table, alternating
+ * address families (IPv6 first) as described by RFC 8305. Returns 0 on
+ * success.
+ */
+static int pf_resolve(char *host, int port)
+{
+	if (!strncmp(host, "unix:", 5)) {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		if (strlen(host + 5) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "pixelflut socket path too long: %s\n", host + 5);
+			return ERR_PF_GETHOST;
+		}
+		strcpy(addr.sun_path, host + 5);
+
+		candidates = calloc(1, sizeof(*candidates));
+		if (candidates == NULL) {
+			perror("couldn't allocate address table");
+			return ERR_ALLOC;
+		}
+		num_candidates = 1;
+		candidates[0].family = AF_UNIX;
+		candidates[0].socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+		candidates[0].addrlen = sizeof(addr);
+		memcpy(&candidates[0].addr, &addr, sizeof(addr));
+		return 0;
+	}
 
-	/* resolve host */
 	struct addrinfo *address;
 	struct addrinfo hints = {
 		.ai_family = AF_UNSPEC,
-		.ai_socktype = SOCK_STREAM,
+		.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM,
 	};
 	char service[15];
 	snprintf(service, 15, "%d", port);
@@ -130,142 +749,2809 @@ int pf_connect(int pool_size, char *host, int port)
 		return ERR_PF_GETHOST;
 	}
 
-	/* connect to pixelflut */
-	for (int i = 0; i < num_conns; i++) {
-		int fp = pf_connect1(address);
-		if (fp < 0) {
-			pf_close();
-			return -fp;
-		}
-		conns[i] = fp;
-	}
-
-	return 0;
-}
-
-/* FIXME currently broken with async I/O */
-int pf_size(struct pf_size *ret)
-{
-	/* get next connection from pool */
-	int fd = conns[active_conn_i];
-	active_conn_i = (active_conn_i + 1) % num_conns;
+	num_candidates = 0;
+	for (struct addrinfo *p = address; p; p = p->ai_next)
+		num_candidates++;
 
-	if (write(fd, "SIZE\n", 5) != 5) {
-		perror("couldn't write size request");
-		return ERR_PF_SEND;
+	candidates = calloc(num_candidates, sizeof(*candidates));
+	if (candidates == NULL) {
+		perror("couldn't allocate address table");
+		freeaddrinfo(address);
+		return ERR_ALLOC;
 	}
 
-	char buf[32];
-	if (!read_until(fd, '\n', buf, sizeof(buf))) {
-		perror("couldn't read size response");
-		return ERR_PF_RECV;
-	}
+	/* interleave families, keeping the resolver's order within each */
+	struct addrinfo *v6 = address, *other = address;
+	for (int n = 0; n < num_candidates; n++) {
+		while (v6 && v6->ai_family != AF_INET6)
+			v6 = v6->ai_next;
+		while (other && other->ai_family == AF_INET6)
+			other = other->ai_next;
 
-	int w, h;
-	if (sscanf(buf, "SIZE %12d %12d\n", &w, &h) != 2) {
-		perror("couldn't parse size response");
-		return ERR_PF_RECV;
+		struct addrinfo **pick = &v6;
+		if (*pick == NULL || (n % 2 && other))
+			pick = &other;
+
+		struct pf_candidate *c = &candidates[n];
+		c->family = (*pick)->ai_family;
+		c->socktype = (*pick)->ai_socktype;
+		c->protocol = (*pick)->ai_protocol;
+		c->addrlen = (*pick)->ai_addrlen;
+		memcpy(&c->addr, (*pick)->ai_addr, c->addrlen);
+		*pick = (*pick)->ai_next;
 	}
 
-	ret->w = w;
-	ret->h = h;
+	freeaddrinfo(address);
 	return 0;
 }
 
-int pf_set(int x, int y, unsigned char r, unsigned char g, unsigned char b)
+/*
+ * pf_attempt starts a non-blocking connect to candidate c. Returns the fd, or
+ * -1 if the attempt failed immediately. Sets *done if it already succeeded.
+ */
+static int pf_attempt(const struct pf_candidate *c, bool *done)
 {
-	/* get next connection from pool */
-	int fd = conns[active_conn_i];
-	active_conn_i = (active_conn_i + 1) % num_conns;
+	int fd = socket(c->family, c->socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, c->protocol);
+	if (fd == -1)
+		return -1;
 
-	int err = dprintf(fd, "PX %d %d %02x%02x%02x\n", x, y, r, g, b);
-	if (err < 0)
-		return ERR_PF_SEND;
+	*done = !connect(fd, (const struct sockaddr *) &c->addr, c->addrlen);
+	if (!*done && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
 
-	return 0;
+	return fd;
 }
 
-int pf_set_buf(const uint32_t * const fb, const int width, const int x1, const int x2, const int y1, const int y2, const uint32_t bgcolor)
+/*
+ * pf_connect_slots connects every slot listed in slots concurrently, putting
+ * the fd of slots[k] in fds[k] and the candidate it reached in picked[k],
+ * unless picked is NULL. Each slot races its candidates happy-eyeballs style:
+ * the next one is tried when the previous fails or hasn't finished after
+ * CONNECT_ATTEMPT_DELAY. Slots that haven't connected after connect_timeout
+ * ms fail. With spread_pool, slot i starts at candidate i, so the pool is
+ * spread across all addresses of a load-balanced server. Returns the number
+ * of slots connected; slots that failed get fd -1.
+ */
+static int pf_connect_slots(const int *slots, int *fds, int *picked, int n)
 {
-	static const uint32_t *last_buf = NULL;
-	static int skip_reblit = 0;
-
-	const bool ignore_bgcolor = (bgcolor == PF_NO_BGCOLOR);
+	struct pf_pending {
+		int fd;
+		int slot;	/* index into slots */
+		int candidate;
+	};
 
-	if (pt_active)
-		clock_gettime(CLOCK_MONOTONIC_RAW, &pt_running);
+	for (int k = 0; k < n; k++)
+		fds[k] = -1;
 
-	for (int round = 0; round < ROUNDS; round++) {
+	int max_pending = n * num_candidates;
+	struct pf_pending *pending = calloc(max_pending, sizeof(*pending));
+	struct pollfd *pfds = calloc(max_pending, sizeof(*pfds));
+	struct {
+		int tried;
+		int active;
+		int64_t last_start;
+		bool done;
+	} *state = calloc(n, sizeof(*state));
+	if (pending == NULL || pfds == NULL || state == NULL) {
+		perror("couldn't allocate connection attempts");
+		free(pending);
+		free(pfds);
+		free(state);
+		return 0;
+	}
 
-		for (int y = y1, row_start_i = y1 * width; y < y2; y++, row_start_i += width) {
+	int num_pending = 0, connected = 0, failed = 0;
+	const int64_t deadline = pf_now_ms() + connect_timeout;
 
-			/* stagger updates in rounds so we blit pixels ASAP */
-			int row_round = (round + y) % ROUNDS;
-			int row_bias = (row_round * STAGGER) % ROUNDS;
-			int xi = x1 + row_bias;
+	while (connected + failed < n) {
+		int64_t now = pf_now_ms();
+		if (now >= deadline)
+			break;
 
-			for (int x = xi, i = row_start_i + xi; x < x2; x += ROUNDS, i += ROUNDS) {
-				skip_reblit = (skip_reblit + 1) % REBLIT_FREQUENCY;
+		/* start new attempts where due */
+		int64_t wake = deadline;
+		for (int k = 0; k < n; k++) {
+			while (!state[k].done && state[k].tried < num_candidates
+					&& (!state[k].active || now - state[k].last_start >= CONNECT_ATTEMPT_DELAY)) {
+				int first = spread_pool ? slots[k] : 0;
+				const int candidate = (first + state[k].tried) % num_candidates;
+				state[k].tried++;
 
-				/* get next connection from pool */
-				int fd = conns[active_conn_i];
-				active_conn_i = (active_conn_i + 1) % num_conns;
+				bool done;
+				int fd = pf_attempt(&candidates[candidate], &done);
+				if (fd == -1)
+					continue;
 
-				uint32_t color = fb[i];
+				state[k].last_start = now;
+				if (done) {
+					fds[k] = fd;
+					if (picked)
+						picked[k] = candidate;
+					state[k].done = true;
+					connected++;
+					break;
+				}
 
-				/* skip redundant pixels. sometimes reblit anyway if skip_reblit reaches zero */
-				if (last_buf && last_buf[i] == color && (ignore_bgcolor || (color & 0x00ffffff) == bgcolor || skip_reblit))
-					continue;
+				pending[num_pending].fd = fd;
+				pending[num_pending].slot = k;
+				pending[num_pending].candidate = candidate;
+				num_pending++;
+				state[k].active++;
+			}
 
-				/* extract colors */
-				unsigned char b = (color >>  0) & 0xff;
-				unsigned char g = (color >>  8) & 0xff;
-				unsigned char r = (color >> 16) & 0xff;
+			if (state[k].done)
+				continue;
 
-				/* assemble into string and print */
-				dprintf(fd, "PX %d %d %02x%02x%02x\n", x, y, r, g, b);
+			if (!state[k].active) {
+				/* every candidate failed */
+				state[k].done = true;
+				failed++;
+			} else if (state[k].tried < num_candidates && state[k].last_start + CONNECT_ATTEMPT_DELAY < wake) {
+				wake = state[k].last_start + CONNECT_ATTEMPT_DELAY;
 			}
 		}
-	}
 
-	if (pt_active) {
-		clock_gettime(CLOCK_MONOTONIC_RAW, &pt_trials[pt_trial]);
+		if (!num_pending)
+			continue;
 
-		/* get the time difference */
-		pt_trials[pt_trial].tv_sec -= pt_running.tv_sec;
-		pt_trials[pt_trial].tv_nsec -= pt_running.tv_nsec;
-		if (pt_trials[pt_trial].tv_nsec < 0) {
-			pt_trials[pt_trial].tv_sec--;
-			pt_trials[pt_trial].tv_nsec += 1000 * 1000 * 1000;
+		for (int p = 0; p < num_pending; p++) {
+			pfds[p].fd = pending[p].fd;
+			pfds[p].events = POLLOUT;
+			pfds[p].revents = 0;
 		}
-		pt_trial++;
 
-		if (pt_trial == PT_TRIALS) {
-			for (pt_trial = 0; pt_trial < PT_TRIALS; pt_trial++)
-				fprintf(stderr, "trial %d / %d: %lld.%09ld sec\n",
-						pt_trial + 1,
-						PT_TRIALS,
-						(long long int) pt_trials[pt_trial].tv_sec,
-						pt_trials[pt_trial].tv_nsec);
-			return EXCEPTION_PT_FINISHED;
+		int timeout = wake - now;
+		if (poll(pfds, num_pending, timeout > 0 ? timeout : 0) <= 0)
+			continue;
+
+		/* reap finished attempts, compacting the pending table */
+		int kept = 0;
+		for (int p = 0; p < num_pending; p++) {
+			int k = pending[p].slot;
+
+			if (state[k].done) {
+				close(pending[p].fd);
+				continue;
+			}
+
+			if (!pfds[p].revents) {
+				pending[kept++] = pending[p];
+				continue;
+			}
+
+			int err;
+			socklen_t errlen = sizeof(err);
+			if (getsockopt(pending[p].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+				close(pending[p].fd);
+				state[k].active--;
+				continue;
+			}
+
+			fds[k] = pending[p].fd;
+			if (picked)
+				picked[k] = pending[p].candidate;
+			state[k].done = true;
+			connected++;
 		}
+		num_pending = kept;
 	}
 
-	last_buf = fb;
-	return 0;
-}
+	/* losers of the race and attempts that timed out */
+	for (int p = 0; p < num_pending; p++)
+		close(pending[p].fd);
 
-void pf_close(void)
-{
-	for (int i = 0; i < num_conns; i++)
-		if (conns[i])
-			close(conns[i]);
-	num_conns = 0;
+	free(pending);
+	free(pfds);
+	free(state);
+	return connected;
+}
+
+/*
+ * read_until reads from fd until sep is reached, then replaces sep with a null
+ * terminator. Returns true if sep was reached.
+ */
+static bool read_until(int fd, char sep, char *buf, int buf_len)
+{
+	for (int i = 0; i < buf_len; i++, buf++) {
+		int n = read(fd, buf, 1);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			if (poll(&pfd, 1, connect_timeout) != 1)
+				return false;
+			n = read(fd, buf, 1);
+		}
+		if (n != 1)
+			return false;
+
+		if (*buf == sep) {
+			*buf = '\0';
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* view_register makes the pool of the calling thread visible to the metrics thread */
+static void view_register(void)
+{
+	if (view.registered)
+		return;
+
+	view.conns = &conns;
+	view.num_conns = &num_conns;
+	view.backlog_ms = &backlog_ms;
+	pthread_mutex_lock(&views_lock);
+	view.next = views;
+	views = &view;
+	view.registered = true;
+	pthread_mutex_unlock(&views_lock);
+}
+
+static void view_unregister(void)
+{
+	if (!view.registered)
+		return;
+
+	pthread_mutex_lock(&views_lock);
+	for (struct pf_view **v = &views; *v; v = &(*v)->next) {
+		if (*v == &view) {
+			*v = view.next;
+			break;
+		}
+	}
+	view.registered = false;
+	pthread_mutex_unlock(&views_lock);
+}
+
+int pf_connect(int pool_size, char *host, int port, int timeout_ms, bool spread)
+{
+	if (pool_size < 1)
+		return ERR_BADARG;
+
+	view_register();
+	connect_timeout = timeout_ms;
+	spread_pool = spread;
+
+	/* pf_canvas maps it once the size is known */
+	if (!strncmp(host, "shm:", 4)) {
+		shm_fd = open(host + 4, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+		if (shm_fd == -1) {
+			perror("couldn't open shared canvas");
+			return ERR_PF_CONNECT;
+		}
+		return 0;
+	}
+
+	if (!strncmp(host, "relay:", 6)) {
+		host += 6;
+		relay = true;
+		if (pool_size != 1)
+			fprintf(stderr, "DEBUG: the relay gets one connection, it has a pool of its own\n");
+		pool_size = 1;
+		if (udp)
+			fprintf(stderr, "DEBUG: the relay is reached over TCP\n");
+		udp = false;
+	}
+
+	/* allocate memory for the file descriptor table */
+	conns = calloc(pool_size, sizeof(*conns));
+	if (conns == NULL) {
+		perror("couldn't allocate connection pool");
+		return ERR_ALLOC;
+	}
+	num_conns = pool_size;
+	pool_min = pool_max = pool_slots = pool_size;
+	for (int i = 0; i < num_conns; i++) {
+		if (conn_init(&conns[i])) {
+			pool_slots = i;
+			pf_close();
+			return ERR_ALLOC;
+		}
+		conns[i].state = CONN_UP;
+	}
+
+	int *slots = calloc((size_t) num_conns, sizeof(*slots));
+	int *fds = calloc((size_t) num_conns, sizeof(*fds));
+	if (slots == NULL || fds == NULL) {
+		perror("couldn't allocate connection pool");
+		free(slots);
+		free(fds);
+		pf_close();
+		return ERR_ALLOC;
+	}
+	for (int i = 0; i < num_conns; i++)
+		slots[i] = i;
+
+	int err = pf_resolve(host, port);
+	if (err) {
+		free(slots);
+		free(fds);
+		pf_close();
+		return err;
+	}
+
+	/* connect to pixelflut */
+	int connected = pf_connect_slots(slots, fds, NULL, num_conns);
+	for (int i = 0; i < num_conns; i++)
+		conns[i].fd = fds[i];
+	free(slots);
+	free(fds);
+	if (connected < num_conns) {
+		fprintf(stderr, "unable to open %d of %d sockets\n", num_conns - connected, num_conns);
+		pf_close();
+		return ERR_PF_CONNECT;
+	}
+
+	for (int i = 0; udp && i < num_conns; i++)
+		conns[i].payload = udp_payload(conns[i].fd);
+
+	return 0;
+}
+
+/* FIXME currently broken with async I/O */
+int pf_size(struct pf_size *ret)
+{
+	/* get next connection from pool */
+	int fd = conns[active_conn_i].fd;
+	active_conn_i = (active_conn_i + 1) % num_conns;
+
+	if (write(fd, "SIZE\n", 5) != 5) {
+		perror("couldn't write size request");
+		return ERR_PF_SEND;
+	}
+
+	char buf[32];
+	if (!read_until(fd, '\n', buf, sizeof(buf))) {
+		perror("couldn't read size response");
+		return ERR_PF_RECV;
+	}
+
+	int w, h;
+	if (sscanf(buf, "SIZE %12d %12d\n", &w, &h) != 2) {
+		perror("couldn't parse size response");
+		return ERR_PF_RECV;
+	}
+
+	ret->w = w;
+	ret->h = h;
+	return 0;
+}
+
+int pf_set(int x, int y, unsigned char r, unsigned char g, unsigned char b)
+{
+	/* get next connection from pool */
+	int fd = conns[active_conn_i].fd;
+	active_conn_i = (active_conn_i + 1) % num_conns;
+
+	int err = dprintf(fd, "PX %d %d %02x%02x%02x\n", x, y, r, g, b);
+	if (err < 0)
+		return ERR_PF_SEND;
+
+	return 0;
+}
+
+static void set_state(struct pf_conn *c, enum pf_conn_state state)
+{
+	__atomic_store_n(&c->state, state, __ATOMIC_RELAXED);
+}
+
+/*
+ * mark_dirty forgets what pixelflut shows at pixel i and queues it to be
+ * resent from the next framebuffer.
+ */
+static void mark_dirty(uint32_t i)
+{
+	if (shadow[i] == SHADOW_DIRTY)
+		return;
+
+	shadow[i] = SHADOW_DIRTY;
+	replay[num_replay++] = i;
+	STATS_ADD(pixels_replayed, 1);
+}
+
+/*
+ * conn_fail closes a dropped connection, queues every pixel that might not
+ * have made it for replay, and schedules a reconnect.
+ */
+static void conn_fail(struct pf_conn *c)
+{
+	for (int k = 0; k < c->num_buffered; k++)
+		mark_dirty(c->buffered[k]);
+	for (int k = 1; k <= c->num_flushed; k++)
+		mark_dirty(c->flushed[(c->flushed_head - k + REPLAY_PIXELS) % REPLAY_PIXELS]);
+	c->num_buffered = 0;
+	c->num_flushed = 0;
+	__atomic_store_n(&c->len, 0, __ATOMIC_RELAXED);
+
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+	out_forget(c);
+
+	if (c->state == CONN_UP) {
+		STATS_ADD(conn_failures, 1);
+		fprintf(stderr, "DEBUG: connection %d dropped, reconnecting in %d ms\n", (int) (c - conns), c->backoff);
+	}
+
+	set_state(c, CONN_DOWN);
+	c->retry_at = pf_now_ms() + c->backoff;
+	c->backoff = c->backoff * 2 < BACKOFF_MAX ? c->backoff * 2 : BACKOFF_MAX;
+}
+
+/*
+ * conn_tick advances the reconnect state machine of a connection that isn't
+ * up, without blocking.
+ */
+static void conn_tick(struct pf_conn *c, int64_t now)
+{
+	if (c->state == CONN_DOWN) {
+		if (now < c->retry_at)
+			return;
+
+		set_state(c, CONN_CONNECTING);
+		c->candidate = 0;
+		c->connect_start = now;
+	}
+
+	for (;;) {
+		if (c->fd < 0) {
+			if (c->candidate == num_candidates || now - c->connect_start >= connect_timeout) {
+				/* out of addresses; c->state is no longer CONN_UP, so this is quiet */
+				conn_fail(c);
+				return;
+			}
+
+			int first = spread_pool ? c - conns : 0;
+			bool done;
+			c->fd = pf_attempt(&candidates[(first + c->candidate++) % num_candidates], &done);
+			if (c->fd < 0)
+				continue;
+			if (!done)
+				return;
+		} else {
+			struct pollfd pfd = { .fd = c->fd, .events = POLLOUT };
+			if (poll(&pfd, 1, 0) != 1) {
+				if (now - c->connect_start >= connect_timeout)
+					conn_fail(c);
+				return;
+			}
+
+			int err;
+			socklen_t errlen = sizeof(err);
+			if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+				close(c->fd);
+				c->fd = -1;
+				continue;
+			}
+		}
+
+		/* connected */
+		conn_setup(c);
+		set_state(c, CONN_UP);
+		c->backoff = BACKOFF_MIN;
+		STATS_ADD(reconnects, 1);
+		fprintf(stderr, "DEBUG: connection %d is up\n", (int) (c - conns));
+		return;
+	}
+}
+
+/*
+ * conns_tick notices connections the server closed and moves reconnects
+ * along. It never blocks.
+ */
+static void conns_tick(void)
+{
+	static __thread char discard[4096];
+	const int64_t now = pf_now_ms();
+
+	for (int i = 0; i < num_conns; i++) {
+		struct pf_conn *c = &conns[i];
+		if (c->state != CONN_UP) {
+			conn_tick(c, now);
+			continue;
+		}
+
+		struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+		if (poll(&pfd, 1, 0) != 1)
+			continue;
+
+		/* notifications of MSG_ZEROCOPY sends raise POLLERR, too */
+		if (pfd.revents & POLLERR && !(pfd.revents & POLLHUP) && c->zc_held && zc_reap(c))
+			continue;
+		if (pfd.revents & (POLLERR | POLLHUP)) {
+			conn_fail(c);
+			continue;
+		}
+
+		/* nobody asked, but pixelflut may talk anyway (errors, help text) */
+		if (recv(c->fd, discard, sizeof(discard), MSG_DONTWAIT) == 0 && !udp)
+			conn_fail(c);
+	}
+}
+
+/* next_conn returns the next connection of the pool that is up, or NULL */
+static struct pf_conn *next_conn(void)
+{
+	for (int n = 0; n < num_conns; n++) {
+		struct pf_conn *c = &conns[active_conn_i];
+		active_conn_i = (active_conn_i + 1) % num_conns;
+		if (c->state == CONN_UP)
+			return c;
+	}
+	return NULL;
+}
+
+/* conn_ok returns true if i is a connection of the pool that is up */
+static bool conn_ok(int i)
+{
+	return i >= 0 && i < num_conns && conns[i].state == CONN_UP;
+}
+
+/* conn_unsent returns the number of bytes in the kernel send queue of c */
+static int conn_unsent(const struct pf_conn *c)
+{
+	int unsent;
+	return ioctl(c->fd, SIOCOUTQ, &unsent) ? 0 : unsent;
+}
+
+/* tile_holder returns the connection whose load includes the work of t */
+static int tile_holder(const struct pf_tile *t)
+{
+	return t->next >= 0 ? t->next : t->owner;
+}
+
+/* tile_give makes connection to own t right away, cancelling any handover */
+static void tile_give(struct pf_tile *t, int to)
+{
+	if (tile_holder(t) >= 0)
+		conns[tile_holder(t)].load -= t->work;
+	t->owner = to;
+	t->next = -1;
+	conns[to].load += t->work;
+}
+
+/*
+ * tile_conn returns the connection that owns the tile t. Tiles without an
+ * owner that is up go to the connection with the least pending work: the
+ * work of its tiles plus whatever is still queued on it, in pixels. Returns
+ * NULL if the whole pool is down.
+ */
+static struct pf_conn *tile_conn(struct pf_tile *t)
+{
+	if (conn_ok(t->owner))
+		return &conns[t->owner];
+
+	int best = -1;
+	uint64_t best_work = 0;
+	for (int i = 0; i < num_conns; i++) {
+		struct pf_conn *c = &conns[i];
+		if (c->state != CONN_UP)
+			continue;
+
+		uint64_t work = c->load + (c->len + conn_unsent(c)) / PX_MINLEN;
+		if (best < 0 || work < best_work) {
+			best = i;
+			best_work = work;
+		}
+	}
+	if (best < 0)
+		return NULL;
+
+	tile_give(t, best);
+	return &conns[best];
+}
+
+/*
+ * tiles_tick runs once per CONTROL_INTERVAL. It completes handovers of tiles
+ * whose previous owner got everything it sent for them acknowledged, so a
+ * tile's updates can't overtake each other, and ages the work counters. Then
+ * it starts handing tiles from the busiest connection to the idlest until
+ * their loads are within 1/TILE_IMBALANCE of the average. Connections that
+ * just came up start out idle, so that's how they get their share.
+ */
+static void tiles_tick(void)
+{
+	const int64_t now = pf_now_ms();
+	if (now - tiles_last < CONTROL_INTERVAL)
+		return;
+	tiles_last = now;
+
+	for (int i = 0; i < pool_slots; i++) {
+		struct pf_conn *c = &conns[i];
+		c->acked = conn_ok(i) ? c->bytes - conn_unsent(c) : 0;
+		c->load = 0;
+	}
+
+	for (int k = 0; k < num_tiles; k++) {
+		struct pf_tile *t = &tiles[k];
+		if (t->next >= 0) {
+			if (!conn_ok(t->next)) {
+				t->next = -1;
+			} else if (!conn_ok(t->owner) || conns[t->owner].acked >= t->mark) {
+				t->owner = t->next;
+				t->next = -1;
+				STATS_ADD(tiles_moved, 1);
+			}
+		}
+
+		t->work /= 2;
+		if (tile_holder(t) >= 0)
+			conns[tile_holder(t)].load += t->work;
+	}
+
+	uint64_t total = 0;
+	int up = 0;
+	for (int i = 0; i < num_conns; i++) {
+		if (conns[i].state == CONN_UP) {
+			total += conns[i].load;
+			up++;
+		}
+	}
+	if (up < 2)
+		return;
+	const uint64_t slack = total / up / TILE_IMBALANCE;
+
+	for (int moves = 0; moves < num_tiles; moves++) {
+		int hi = -1, lo = -1;
+		for (int i = 0; i < num_conns; i++) {
+			if (conns[i].state != CONN_UP)
+				continue;
+			if (hi < 0 || conns[i].load > conns[hi].load)
+				hi = i;
+			if (lo < 0 || conns[i].load < conns[lo].load)
+				lo = i;
+		}
+
+		const uint64_t gap = conns[hi].load - conns[lo].load;
+		if (gap <= slack)
+			return;
+
+		/* the tile that brings the two closest to even */
+		struct pf_tile *best = NULL;
+		uint64_t best_miss = gap;
+		for (int k = 0; k < num_tiles; k++) {
+			struct pf_tile *t = &tiles[k];
+			if (t->owner != hi || t->next >= 0 || !t->work || t->work >= gap)
+				continue;
+
+			uint64_t miss = gap > 2 * t->work ? gap - 2 * t->work : 2 * t->work - gap;
+			if (miss < best_miss) {
+				best = t;
+				best_miss = miss;
+			}
+		}
+		if (best == NULL)
+			return;
+
+		best->next = lo;
+		best->mark = conns[hi].bytes + conns[hi].len;
+		conns[hi].load -= best->work;
+		conns[lo].load += best->work;
+	}
+}
+
+/*
+ * send_stream writes everything buffered on a TCP connection to its socket.
+ * Returns false if the connection turned out to be dead and was failed.
+ */
+static bool send_stream(struct pf_conn *c)
+{
+	const char *p = c->buf;
+	int left = c->len;
+
+	/* below some size, copying is cheaper than pinning pages */
+	int flags = MSG_NOSIGNAL;
+	if (c->zerocopy && c->len >= zerocopy_min)
+		flags |= MSG_ZEROCOPY;
+
+	while (left > 0) {
+		ssize_t n = send(c->fd, p, left, flags);
+		STATS_ADD(syscalls, 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS && flags & MSG_ZEROCOPY) {
+				/* out of locked memory or optmem */
+				flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				STATS_ADD(eagain, 1);
+				c->stalls++;
+				if (c->zc_held)
+					zc_reap(c);
+				struct pollfd pfd = { .fd = c->fd, .events = POLLOUT };
+				if (poll(&pfd, 1, SEND_STALL_TIMEOUT) == 1)
+					continue;
+			}
+			conn_fail(c);
+			return false;
+		}
+		if (flags & MSG_ZEROCOPY)
+			out_hold(c);
+		STATS_ADD(bytes, n);
+		__atomic_store_n(&c->bytes, c->bytes + n, __ATOMIC_RELAXED);
+		p += n;
+		left -= n;
+	}
+	return true;
+}
+
+/* out_free returns a mapped output buffer of c the kernel doesn't hold, or -1 */
+static int out_free(const struct pf_conn *c)
+{
+	for (int k = 1; k <= ZEROCOPY_BUFS; k++) {
+		int b = (c->cur + k) % ZEROCOPY_BUFS;
+		if (c->out[b].data && !c->out[b].held)
+			return b;
+	}
+	return -1;
+}
+
+/* out_grow maps another output buffer for c and returns it, or -1 */
+static int out_grow(struct pf_conn *c)
+{
+	for (int b = 0; b < ZEROCOPY_BUFS; b++)
+		if (!c->out[b].data)
+			return out_map(&c->out[b]) ? -1 : b;
+	return -1;
+}
+
+/*
+ * out_switch moves encoding on c to a buffer the kernel doesn't hold, after
+ * the current one went out with MSG_ZEROCOPY: one it released, else a new
+ * one, else it waits for a release. Returns false if the connection turned
+ * out to be dead and was failed.
+ */
+static bool out_switch(struct pf_conn *c)
+{
+	int b = out_free(c);
+	if (b < 0 && zc_reap(c))
+		b = out_free(c);
+	if (b < 0)
+		b = out_grow(c);
+
+	while (b < 0) {
+		STATS_ADD(eagain, 1);
+		c->stalls++;
+		struct pollfd pfd = { .fd = c->fd };
+		if (poll(&pfd, 1, SEND_STALL_TIMEOUT) != 1 || !zc_reap(c)) {
+			conn_fail(c);
+			return false;
+		}
+		b = out_free(c);
+	}
+
+	c->cur = b;
+	c->buf = c->out[b].data;
+	return true;
+}
+
+/*
+ * datagram_len returns how much of the len bytes of commands at p go into the
+ * next datagram: all of them, or as many whole ones as fit in payload bytes.
+ */
+static int datagram_len(const char *p, int len, int payload)
+{
+	if (len <= payload)
+		return len;
+
+	const char *end = memrchr(p, '\n', payload);
+	return end ? end - p + 1 : payload;
+}
+
+/*
+ * send_segmented sends up to UDP_BATCH datagrams of the len bytes of commands
+ * at p with a single syscall, handing the kernel a buffer of equal segments
+ * to split itself. Segments are padded with empty lines. Returns how many
+ * bytes of commands went out, 0 if the socket is full, or -1 with errno set.
+ */
+static int send_segmented(struct pf_conn *c, const char *p, int len)
+{
+	static __thread char padded[UDP_MAX];
+
+	const int size = c->payload;
+	int used = 0, filled = 0;
+	for (int seg = 0; seg < UDP_BATCH && used < len && (seg + 1) * size <= UDP_MAX; seg++) {
+		/* only the last segment may be short */
+		memset(padded + filled, '\n', seg * size - filled);
+		filled = seg * size;
+
+		int n = datagram_len(p + used, len - used, size);
+		memcpy(padded + filled, p + used, n);
+		used += n;
+		filled += n;
+	}
+
+	char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+	struct iovec iov = { padded, filled };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t *) CMSG_DATA(cm) = size;
+
+	ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+	STATS_ADD(syscalls, 1);
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	return used;
+}
+
+/*
+ * send_datagrams cuts everything buffered on a UDP connection into datagrams
+ * of whole commands, as large as the path allows, and sends them in batches,
+ * with segmentation offload if it was asked for and works. Lost datagrams
+ * aren't sent again; their pixels are refreshed by reblits. Returns false if
+ * the connection turned out to be dead and was failed.
+ */
+static bool send_datagrams(struct pf_conn *c)
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+
+	int sent = 0;
+	while (sent < c->len) {
+		int n;
+		if (udp_gso) {
+			n = send_segmented(c, c->buf + sent, c->len - sent);
+			if (n < 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+				fprintf(stderr, "DEBUG: no UDP segmentation offload, batching datagrams instead\n");
+				udp_gso = false;
+				continue;
+			}
+		} else {
+			int num_msgs = 0;
+			for (int off = sent; num_msgs < UDP_BATCH && off < c->len; num_msgs++) {
+				iovs[num_msgs].iov_base = c->buf + off;
+				iovs[num_msgs].iov_len = datagram_len(c->buf + off, c->len - off, c->payload);
+				memset(&msgs[num_msgs], 0, sizeof(msgs[num_msgs]));
+				msgs[num_msgs].msg_hdr.msg_iov = &iovs[num_msgs];
+				msgs[num_msgs].msg_hdr.msg_iovlen = 1;
+				off += iovs[num_msgs].iov_len;
+			}
+
+			int done = sendmmsg(c->fd, msgs, num_msgs, MSG_NOSIGNAL);
+			STATS_ADD(syscalls, 1);
+			n = 0;
+			if (done < 0)
+				n = errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+			for (int m = 0; m < done; m++)
+				n += iovs[m].iov_len;
+		}
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			conn_fail(c);
+			return false;
+		}
+		if (!n) {
+			STATS_ADD(eagain, 1);
+			c->stalls++;
+			struct pollfd pfd = { .fd = c->fd, .events = POLLOUT };
+			if (poll(&pfd, 1, SEND_STALL_TIMEOUT) == 1)
+				continue;
+			conn_fail(c);
+			return false;
+		}
+
+		STATS_ADD(bytes, n);
+		__atomic_store_n(&c->bytes, c->bytes + n, __ATOMIC_RELAXED);
+		sent += n;
+	}
+	return true;
+}
+
+/*
+ * flush writes everything buffered on a connection to its socket. If the
+ * connection turns out to be dead, its pixels are queued for replay and
+ * false is returned.
+ */
+static bool flush(struct pf_conn *c)
+{
+	if (!(udp ? send_datagrams(c) : send_stream(c)))
+		return false;
+
+	/* remember what went out in case the connection drops later */
+	for (int k = 0; k < c->num_buffered; k++) {
+		c->flushed[c->flushed_head] = c->buffered[k];
+		c->flushed_head = (c->flushed_head + 1) % REPLAY_PIXELS;
+	}
+	c->num_flushed += c->num_buffered;
+	if (c->num_flushed > REPLAY_PIXELS)
+		c->num_flushed = REPLAY_PIXELS;
+	c->num_buffered = 0;
+
+	__atomic_store_n(&c->len, 0, __ATOMIC_RELAXED);
+
+	/* the kernel may still be reading the buffer */
+	if (c->out[c->cur].held)
+		return out_switch(c);
+	return true;
+}
+
+/* nearest returns the palette color nearest to r, g, b */
+static uint32_t nearest(int r, int g, int b)
+{
+	const pf_palette_lanes vr = (pf_palette_lanes) {0} + r;
+	const pf_palette_lanes vg = (pf_palette_lanes) {0} + g;
+	const pf_palette_lanes vb = (pf_palette_lanes) {0} + b;
+	pf_palette_lanes best = (pf_palette_lanes) {0} + INT32_MAX, which = {0};
+	pf_palette_lanes index = {0};
+	for (int l = 0; l < PALETTE_LANES; l++)
+		index[l] = l;
+
+	/* green counts most, then red, like it does to the eye */
+	for (int k = 0; k < palette->size; k += PALETTE_LANES) {
+		pf_palette_lanes dr, dg, db;
+		memcpy(&dr, &palette->r[k], sizeof(dr));
+		memcpy(&dg, &palette->g[k], sizeof(dg));
+		memcpy(&db, &palette->b[k], sizeof(db));
+		dr -= vr;
+		dg -= vg;
+		db -= vb;
+		const pf_palette_lanes d = 3 * dr * dr + 4 * dg * dg + 2 * db * db;
+		const pf_palette_lanes closer = d < best;
+		best = (best & ~closer) | (d & closer);
+		which = (which & ~closer) | (index & closer);
+		index += PALETTE_LANES;
+	}
+
+	int k = 0;
+	for (int l = 1; l < PALETTE_LANES; l++)
+		if (best[l] < best[k])
+			k = l;
+	return palette->color[which[k]];
+}
+
+/*
+ * quantized returns color, dithered for pixel i of the canvas unless it's
+ * NOWHERE, on the palette or in levels
+ */
+static uint32_t quantized(uint32_t color, uint32_t i)
+{
+	int r = color >> 16, g = color >> 8 & 0xff, b = color & 0xff;
+	if (dithering && i != NOWHERE) {
+		const int d = dither[i / canvas_w & 3][i % canvas_w & 3];
+		r = r + d < 0 ? 0 : r + d > 255 ? 255 : r + d;
+		g = g + d < 0 ? 0 : g + d > 255 ? 255 : g + d;
+		b = b + d < 0 ? 0 : b + d > 255 ? 255 : b + d;
+	}
+	if (!palette)
+		return quantum[r] << 16 | quantum[g] << 8 | quantum[b];
+
+	const int shift = 8 - INVERSE_BITS;
+	uint32_t *cell = &palette->inverse[(r >> shift) << (2 * INVERSE_BITS) | (g >> shift) << INVERSE_BITS | b >> shift];
+	if (*cell == INVERSE_UNKNOWN) {
+		const int half = 1 << shift >> 1;
+		*cell = nearest((r >> shift << shift) + half, (g >> shift << shift) + half, (b >> shift << shift) + half);
+	}
+	return *cell;
+}
+
+/*
+ * look_up returns the color pixelflut should show for framebuffer pixel px,
+ * at position i of the canvas or NOWHERE
+ */
+static inline uint32_t look_up(uint32_t px, uint32_t i)
+{
+	uint32_t color = px & 0x00ffffff;
+	if (transform)
+		color = lut[0][px >> 16 & 0xff] | lut[1][px >> 8 & 0xff] | lut[2][px & 0xff];
+	if (quantize)
+		color = quantized(color, i);
+	return color;
+}
+
+/* put_uint writes the decimal representation of v to p and returns its length */
+static int put_uint(char *p, unsigned int v)
+{
+	char tmp[10];
+	int n = 0;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	for (int i = 0; i < n; i++)
+		p[i] = tmp[n - 1 - i];
+	return n;
+}
+
+/* encode_px writes a "PX x y rrggbb\n" command to p and returns its length */
+static int encode_px(char *p, int x, int y, uint32_t color)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *start = p;
+
+	*p++ = 'P';
+	*p++ = 'X';
+	*p++ = ' ';
+	p += put_uint(p, x + offset_x);
+	*p++ = ' ';
+	p += put_uint(p, y + offset_y);
+	*p++ = ' ';
+
+	/* RGB32 is stored as 0xXXRRGGBB */
+	for (int shift = 20; shift >= 0; shift -= 4)
+		*p++ = hex[(color >> shift) & 0xf];
+	*p++ = '\n';
+
+	return p - start;
+}
+
+/*
+ * encode_block writes the commands of the block that pixel (x, y) of the
+ * canvas upscales to, in color, to p and returns their length
+ */
+static int encode_block(char *p, int x, int y, uint32_t color)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *start = p;
+
+	char rgb[7];
+	for (int k = 0, shift = 20; shift >= 0; k++, shift -= 4)
+		rgb[k] = hex[(color >> shift) & 0xf];
+	rgb[6] = '\n';
+
+	/* whole fragments are copied; what overshoots is overwritten next */
+	const struct block_coord *bx = &block_x[x * upscale], *by = &block_y[y * upscale];
+	for (int dy = 0; dy < upscale; dy++) {
+		for (int dx = 0; dx < upscale; dx++) {
+			memcpy(p, bx[dx].s, sizeof(bx[dx].s));
+			p += bx[dx].len;
+			memcpy(p, by[dy].s, sizeof(by[dy].s));
+			p += by[dy].len;
+			memcpy(p, rgb, sizeof(rgb));
+			p += sizeof(rgb);
+		}
+	}
+	return p - start;
+}
+
+/* block_coords writes the starts of the lines of blocks for the canvas */
+static void block_coords(void)
+{
+	for (int x = 0; x < canvas_w * upscale; x++) {
+		char *q = block_x[x].s;
+		*q++ = 'P';
+		*q++ = 'X';
+		*q++ = ' ';
+		q += put_uint(q, x + offset_x);
+		*q++ = ' ';
+		block_x[x].len = q - block_x[x].s;
+	}
+	for (int y = 0; y < canvas_h * upscale; y++) {
+		char *q = block_y[y].s;
+		q += put_uint(q, y + offset_y);
+		*q++ = ' ';
+		block_y[y].len = q - block_y[y].s;
+	}
+}
+
+/*
+ * conn_size_sndbuf grows the send buffer of c to twice its bandwidth-delay
+ * product, given the goodput it just achieved. If the buffer was full and is
+ * about as large as what's in flight, it is what limits the rate, so it's
+ * doubled instead. Buffers are never shrunk: pinning SO_SNDBUF switches off
+ * the kernel's own tuning, which does better than a rate measured while
+ * something else was the bottleneck.
+ */
+static void conn_size_sndbuf(struct pf_conn *c, double goodput, bool stalled)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	if (getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) || !ti.tcpi_rtt)
+		return;
+
+	double bdp = goodput * ti.tcpi_rtt / 1e6;
+	int cur = get_sndbuf(c->fd);
+	double want = 2 * bdp;
+	if (stalled && want >= cur)
+		want = 2.0 * cur;
+
+	if (want > SNDBUF_MAX)
+		want = SNDBUF_MAX;
+
+	if (want > cur * 1.25)
+		set_sndbuf(c->fd, want);
+}
+
+/*
+ * pool_resize grows or shrinks the pool to n connections. New connections
+ * are opened in the background by conns_tick; removed ones are flushed and
+ * closed.
+ */
+static void pool_resize(int n)
+{
+	const int64_t now = pf_now_ms();
+
+	for (int i = num_conns; i < n; i++) {
+		struct pf_conn *c = &conns[i];
+		c->fd = -1;
+		c->state = CONN_DOWN;
+		c->retry_at = now;
+		c->backoff = BACKOFF_MIN;
+		c->num_buffered = 0;
+		c->num_flushed = 0;
+		c->len = 0;
+		c->ctl_bytes = c->bytes;
+		c->ctl_stalls = c->stalls;
+	}
+
+	for (int i = n; i < num_conns; i++) {
+		struct pf_conn *c = &conns[i];
+		if (c->state == CONN_UP && c->len)
+			flush(c);
+		if (c->fd >= 0) {
+			close(c->fd);
+			c->fd = -1;
+		}
+		out_forget(c);
+		set_state(c, CONN_DOWN);
+		c->num_buffered = 0;
+		c->num_flushed = 0;
+	}
+
+	__atomic_store_n(&num_conns, n, __ATOMIC_RELAXED);
+	active_conn_i %= n;
+}
+
+/*
+ * pool_tick runs the autoscaling controller once per CONTROL_INTERVAL. As long
+ * as sockets stall on full send buffers, the network is the bottleneck, so it
+ * hill-climbs the pool size on measured goodput: keep going while goodput
+ * improves, turn around when it drops, and give back connections that
+ * didn't help. Without stalls, the pool slowly shrinks towards its minimum.
+ */
+static void pool_tick(void)
+{
+	const int64_t now = pf_now_ms();
+	if (!ctl.last) {
+		ctl.last = now;
+		ctl.direction = 1;
+		return;
+	}
+	if (now - ctl.last < CONTROL_INTERVAL)
+		return;
+
+	const double secs = (now - ctl.last) / 1000.0;
+	ctl.last = now;
+
+	uint64_t bytes = 0, stalls = 0;
+	for (int i = 0; i < num_conns; i++) {
+		struct pf_conn *c = &conns[i];
+		uint64_t conn_bytes = c->bytes - c->ctl_bytes;
+		uint64_t conn_stalls = c->stalls - c->ctl_stalls;
+		c->ctl_bytes = c->bytes;
+		c->ctl_stalls = c->stalls;
+		bytes += conn_bytes;
+		stalls += conn_stalls;
+
+		if (c->state == CONN_UP && !sndbuf_factor)
+			conn_size_sndbuf(c, conn_bytes / secs, conn_stalls);
+	}
+
+	const double goodput = bytes / secs;
+	const double last = ctl.goodput;
+	ctl.goodput = goodput;
+
+	int n = num_conns;
+	if (!stalls) {
+		if (++ctl.idle >= CONTROL_IDLE && n > pool_min) {
+			ctl.idle = 0;
+			ctl.direction = -1;
+			n--;
+		}
+	} else {
+		ctl.idle = 0;
+		if (goodput < last * (1 - CONTROL_GAIN))
+			ctl.direction = -ctl.direction;
+		else if (goodput < last * (1 + CONTROL_GAIN) && ctl.direction > 0)
+			ctl.direction = -1;
+
+		int step = n / 8 > 1 ? n / 8 : 1;
+		n += ctl.direction * step;
+	}
+
+	if (n < pool_min)
+		n = pool_min;
+	if (n > pool_max)
+		n = pool_max;
+	if (n == num_conns)
+		return;
+
+	fprintf(stderr, "DEBUG: %.1f MB/s over %d connections, now using %d\n", goodput / 1e6, num_conns, n);
+	pool_resize(n);
+}
+
+int pf_autoscale(int min, int max)
+{
+	if (shm_fd >= 0 || relay)
+		return 0;
+
+	/* connections past max are closed, and their slots kept */
+	if (num_conns > max)
+		pool_resize(max);
+
+	if (max > pool_slots) {
+		struct pf_conn *c = realloc(conns, max * sizeof(*conns));
+		if (c == NULL) {
+			perror("couldn't allocate connection pool");
+			return ERR_ALLOC;
+		}
+		conns = c;
+		for (int i = pool_slots; i < max; i++) {
+			if (conn_init(&conns[i])) {
+				pool_slots = i;
+				return ERR_ALLOC;
+			}
+			conns[i].state = CONN_DOWN;
+		}
+		pool_slots = max;
+	}
+	pool_min = min;
+	pool_max = max;
+	autoscale = true;
+
+	if (num_conns < min)
+		pool_resize(min);
+	return 0;
+}
+
+int pf_canvas(int width, int height)
+{
+	canvas_w = width;
+	canvas_h = height;
+	dirty_x = ((width - 1) >> DIRTY_SHIFT) + 1;
+	num_dirty = dirty_x * (((height - 1) >> DIRTY_SHIFT) + 1);
+
+	shadow = malloc(width * height * sizeof(*shadow));
+	replay = malloc(width * height * sizeof(*replay));
+	dirty = calloc(num_dirty, sizeof(*dirty));
+	buckets[0].ring = malloc(BUCKETS * num_dirty * sizeof(*buckets[0].ring));
+	parked = malloc(num_dirty * sizeof(*parked));
+	changed = malloc((SEND_SLICE + DIRTY_AREA) * sizeof(*changed));
+	if (shadow == NULL || replay == NULL || dirty == NULL || buckets[0].ring == NULL || parked == NULL || changed == NULL) {
+		perror("couldn't allocate shadow canvas");
+		return ERR_ALLOC;
+	}
+
+	for (int i = 0; i < width * height; i++)
+		shadow[i] = SHADOW_UNKNOWN;
+	num_replay = 0;
+	for (int b = 0; b < BUCKETS; b++) {
+		buckets[b].ring = buckets[0].ring + b * num_dirty;
+		buckets[b].head = 0;
+		buckets[b].len = 0;
+	}
+	num_queued = 0;
+	num_parked = 0;
+
+	if (calm) {
+		previous = malloc(width * height * sizeof(*previous));
+		toggles = calloc(width * height, sizeof(*toggles));
+		if (previous == NULL || toggles == NULL) {
+			perror("couldn't allocate flicker history");
+			return ERR_ALLOC;
+		}
+		for (int i = 0; i < width * height; i++)
+			previous[i] = SHADOW_UNKNOWN;
+	}
+
+	/* the relay and shm consumers get the canvas as it is */
+	if (upscale > 1 && (relay || shm_fd >= 0)) {
+		fprintf(stderr, "DEBUG: not upscaling for %s\n", relay ? "the relay, pass -x to it instead" : "shm");
+		upscale = 1;
+	}
+	if (upscale > 1) {
+		block_x = malloc(width * upscale * sizeof(*block_x));
+		block_y = malloc(height * upscale * sizeof(*block_y));
+		if (block_x == NULL || block_y == NULL) {
+			perror("couldn't allocate blocks");
+			return ERR_ALLOC;
+		}
+		block_coords();
+	}
+
+	if (shm_fd >= 0) {
+		shm_len = sizeof(*shm) + (size_t) width * height * sizeof(shm->pixels[0]);
+		if (ftruncate(shm_fd, shm_len)) {
+			perror("couldn't size shared canvas");
+			return ERR_PF_CONNECT;
+		}
+		shm = mmap(NULL, shm_len, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+		if (shm == MAP_FAILED) {
+			shm = NULL;
+			perror("couldn't map shared canvas");
+			return ERR_PF_CONNECT;
+		}
+		shm->width = width;
+		shm->height = height;
+		__atomic_store_n(&shm->magic, PF_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	if (assign_mode == PF_ASSIGN_PIXELS)
+		return 0;
+
+	/* bands are tiles as wide as any framebuffer can be */
+	tile_shift_x = assign_mode == PF_ASSIGN_TILES ? TILE_SHIFT : 30;
+	tile_shift_y = assign_mode == PF_ASSIGN_TILES ? TILE_SHIFT : BAND_SHIFT;
+	tiles_x = ((width - 1) >> tile_shift_x) + 1;
+	num_tiles = tiles_x * (((height - 1) >> tile_shift_y) + 1);
+	tiles = calloc(num_tiles, sizeof(*tiles));
+	if (tiles == NULL) {
+		perror("couldn't allocate tiles");
+		return ERR_ALLOC;
+	}
+	for (int k = 0; k < num_tiles; k++) {
+		tiles[k].owner = -1;
+		tiles[k].next = -1;
+	}
+	return 0;
+}
+
+void pf_udp(bool gso)
+{
+	udp = true;
+	udp_gso = gso;
+}
+
+void pf_assign(enum pf_assign mode)
+{
+	assign_mode = mode;
+}
+
+void pf_order(enum order o)
+{
+	send_order = o;
+}
+
+void pf_calm(bool on)
+{
+	calm = on;
+}
+
+void pf_prefilled(bool on)
+{
+	prefilled = on;
+}
+
+/*
+ * background samples a few pixels of fb and returns the color that lately
+ * covers at least 1/BG_SHARE of the canvas, or PF_NO_BGCOLOR.
+ */
+static uint32_t background(const uint32_t * const fb)
+{
+	const uint32_t area = canvas_w * canvas_h;
+	for (int s = 0; s < BG_SAMPLES; s++) {
+		bg.position = (bg.position + BG_STRIDE) % area;
+		const uint32_t color = look_up(fb[bg.position], bg.position);
+
+		/* count it, or make it a candidate, or count every candidate down */
+		int c, empty = -1;
+		for (c = 0; c < BG_CANDIDATES; c++) {
+			if (bg.count[c] && bg.color[c] == color)
+				break;
+			if (!bg.count[c])
+				empty = c;
+		}
+		if (c < BG_CANDIDATES) {
+			bg.count[c]++;
+		} else if (empty >= 0) {
+			bg.color[empty] = color;
+			bg.count[empty] = 1;
+		} else {
+			for (c = 0; c < BG_CANDIDATES; c++)
+				bg.count[c]--;
+		}
+	}
+
+	bg.samples += BG_SAMPLES;
+	if (bg.samples < BG_WINDOW)
+		return bg.found;
+
+	int best = 0;
+	for (int c = 1; c < BG_CANDIDATES; c++)
+		if (bg.count[c] > bg.count[best])
+			best = c;
+
+	/* counts are low by at most BG_WINDOW / (BG_CANDIDATES + 1) */
+	uint32_t found = PF_NO_BGCOLOR;
+	if (bg.count[best] >= BG_WINDOW / BG_SHARE - BG_WINDOW / (BG_CANDIDATES + 1))
+		found = bg.color[best];
+	if (found != bg.found && found != PF_NO_BGCOLOR)
+		fprintf(stderr, "DEBUG: background is %06x\n", found);
+
+	bg.found = found;
+	bg.samples = 0;
+	memset(bg.count, 0, sizeof(bg.count));
+	return found;
+}
+
+/*
+ * tile_priority returns the bucket dirty tile t belongs in: the further it
+ * is from the pointer, and the longer ago it was damaged, the later it's
+ * sent. Both count in powers of two. Tiles other clients painted over come
+ * first, before anybody notices.
+ */
+static int tile_priority(int t, int64_t now)
+{
+	int level = 0;
+
+	if (dirty[t].overwritten)
+		return 0;
+
+	if (cursor_x >= 0) {
+		int dx = abs(t % dirty_x - (cursor_x >> DIRTY_SHIFT));
+		int dy = abs(t / dirty_x - (cursor_y >> DIRTY_SHIFT));
+		int d = dx > dy ? dx : dy;
+		if (d)
+			level += 32 - __builtin_clz(d);
+	}
+
+	uint64_t age = (now - dirty[t].damaged_at) / RECENT_MS;
+	if (age)
+		level += 64 - __builtin_clzll(age);
+
+	return level < BUCKETS ? level : BUCKETS - 1;
+}
+
+static void queue_push(int t, int64_t now)
+{
+	struct pf_bucket *b = &buckets[tile_priority(t, now)];
+	b->ring[(b->head + b->len++) % num_dirty] = t;
+	num_queued++;
+}
+
+/*
+ * queue_pop takes the next dirty tile. Every other turn goes to bucket 0,
+ * every fourth to bucket 1, and so on; the best bucket that isn't empty
+ * stands in for an empty one. Tiles far from the pointer or with old damage
+ * thus get fewer turns, but are never starved.
+ */
+static int queue_pop(void)
+{
+	int b = __builtin_ctz(++turn | 1 << (BUCKETS - 1));
+	if (!buckets[b].len)
+		for (b = 0; !buckets[b].len; b++);
+
+	struct pf_bucket *q = &buckets[b];
+	int t = q->ring[q->head];
+	q->head = (q->head + 1) % num_dirty;
+	q->len--;
+	num_queued--;
+	return t;
+}
+
+/* damage queues the dirty tiles that a rect overlaps */
+static void damage(int x1, int x2, int y1, int y2, int64_t now)
+{
+	x1 = x1 < 0 ? 0 : x1;
+	y1 = y1 < 0 ? 0 : y1;
+	x2 = x2 > canvas_w ? canvas_w : x2;
+	y2 = y2 > canvas_h ? canvas_h : y2;
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	for (int ty = y1 >> DIRTY_SHIFT; ty <= (y2 - 1) >> DIRTY_SHIFT; ty++) {
+		for (int tx = x1 >> DIRTY_SHIFT; tx <= (x2 - 1) >> DIRTY_SHIFT; tx++) {
+			const int t = ty * dirty_x + tx;
+			struct pf_dirty *d = &dirty[t];
+
+			/* several rects of one frame count once */
+			if (now > d->damaged_at) {
+				float interval = d->damaged_at ? now - d->damaged_at : RATE_COLD;
+				d->interval += RATE_WEIGHT * (interval - d->interval);
+				d->damaged_at = now;
+			}
+
+			if (d->state == DIRTY_CLEAN) {
+				d->state = DIRTY_QUEUED;
+				d->cursor = 0;
+				d->deficit = 0;
+				queue_push(t, now);
+			} else if (d->state == DIRTY_CONVERGE && !d->cursor) {
+				/* the exact pass can wait; this can't */
+				d->state = DIRTY_QUEUED;
+			} else if (d->cursor) {
+				/* part of it was diffed against an older frame */
+				d->state = DIRTY_AGAIN;
+			}
+		}
+	}
+}
+
+void pf_damage(int x1, int x2, int y1, int y2)
+{
+	damage(x1, x2, y1, y2, pf_now_ms());
+	STATS_ADD(rects, 1);
+}
+
+bool pf_pending(void)
+{
+	if (!num_queued && !num_replay)
+		return false;
+	if (shm)
+		return true;
+
+	/* nothing can be sent until the pool reconnects */
+	for (int i = 0; i < num_conns; i++)
+		if (conns[i].state == CONN_UP)
+			return true;
+	return false;
+}
+
+void pf_cursor(int x, int y)
+{
+	cursor_x = x;
+	cursor_y = y;
+}
+
+void pf_rate_cap(double hz)
+{
+	rate_cap = hz;
+}
+
+void pf_threshold(int distance)
+{
+	threshold = distance;
+}
+
+/*
+ * tile_parked_until returns until when dirty tile d must wait before its
+ * cursor may start over, or 0. Tiles that change faster than rate_cap are
+ * refreshed at most rate_cap times per second, and approximate tiles are
+ * made exact once they've been quiet for CONVERGE_QUIET.
+ */
+static int64_t tile_parked_until(const struct pf_dirty *d)
+{
+	if (d->cursor)
+		return 0;
+	if (d->state == DIRTY_CONVERGE)
+		return d->damaged_at + CONVERGE_QUIET;
+	if (!rate_cap || d->interval >= 1000 / rate_cap)
+		return 0;
+	return d->walk_at + 1000 / rate_cap;
+}
+
+int pf_wake_ms(void)
+{
+	int64_t now = pf_now_ms();
+
+	/* check again whether the sockets have drained */
+	int64_t wake = overloaded ? now + BACKLOG_WINDOW : -1;
+
+	/* keep reading back what the server shows */
+	if (verify_rate && (wake < 0 || now + VERIFY_INTERVAL < wake))
+		wake = now + VERIFY_INTERVAL;
+
+	for (int k = 0; k < num_parked; k++) {
+		int64_t until = tile_parked_until(&dirty[parked[k]]);
+		wake = wake < 0 || until < wake ? until : wake;
+	}
+
+	if (wake < 0)
+		return -1;
+	return wake > now ? wake - now : 0;
+}
+
+/* average folds sample into the moving average avg, which is 0 until the first */
+static double average(double avg, double sample)
+{
+	return avg ? avg + BACKLOG_WEIGHT * (sample - avg) : sample;
+}
+
+/*
+ * backlog_tick estimates how long it will take until the server has everything
+ * pending: the dirty tiles, at the bytes per walked pixel seen lately, plus
+ * what sits in the connection buffers and socket send queues, at the rate the
+ * server has been acknowledging bytes while it had some to acknowledge.
+ * considered is how many pixels dirty tile cursors just walked.
+ */
+static void backlog_tick(int considered)
+{
+	rates.pixels += considered;
+
+	const int64_t now = pf_now_ms();
+	if (now - rates.since < BACKLOG_WINDOW)
+		return;
+
+	uint64_t accepted = 0;
+	int buffered = 0, unsent = 0;
+	for (int i = 0; i < num_conns; i++) {
+		accepted += conns[i].bytes;
+		if (conns[i].state == CONN_UP) {
+			buffered += conns[i].len;
+			unsent += conn_unsent(&conns[i]);
+		}
+	}
+	const uint64_t acked = accepted - unsent;
+
+	if (rates.since) {
+		const double ms = now - rates.since;
+		if (rates.pixels && accepted > rates.accepted)
+			rates.bytes_per_px = average(rates.bytes_per_px, (double) (accepted - rates.accepted) / rates.pixels);
+
+		/* an idle link says nothing about its speed */
+		if (rates.unsent && unsent && acked > rates.acked)
+			rates.ack_rate = average(rates.ack_rate, (acked - rates.acked) / ms);
+	}
+	rates.since = now;
+	rates.pixels = 0;
+	rates.accepted = accepted;
+	rates.acked = acked;
+	rates.unsent = unsent;
+
+	/* roughly, since tiles on the edge are smaller and some are half walked */
+	double backlog = 0;
+	if (rates.ack_rate)
+		backlog = (num_queued * DIRTY_AREA * rates.bytes_per_px + buffered + unsent) / rates.ack_rate;
+	__atomic_store_n(&backlog_ms, (int) backlog, __ATOMIC_RELAXED);
+}
+
+void pf_latency_target(int ms)
+{
+	latency_target = ms;
+}
+
+int pf_backlog_ms(void)
+{
+	int max = 0;
+	pthread_mutex_lock(&views_lock);
+	for (const struct pf_view *v = views; v; v = v->next) {
+		int ms = __atomic_load_n(v->backlog_ms, __ATOMIC_RELAXED);
+		if (ms > max)
+			max = ms;
+	}
+	pthread_mutex_unlock(&views_lock);
+	return max;
+}
+
+bool pf_overloaded(void)
+{
+	if (!latency_target)
+		return false;
+
+	backlog_tick(0);
+	if (backlog_ms > latency_target)
+		overloaded = true;
+	else if (!pf_pending())
+		overloaded = false;
+	return overloaded;
+}
+
+void pf_offset(int x, int y)
+{
+	if (x == offset_x && y == offset_y)
+		return;
+	offset_x = x;
+	offset_y = y;
+	if (block_x)
+		block_coords();
+}
+
+void pf_upscale(int factor)
+{
+	upscale = factor;
+}
+
+int pf_colors(const char *spec)
+{
+	double gamma = 1, brightness = 1, contrast = 1, strength = 0;
+	int levels = 256, colors = 0;
+
+	char settings[PF_COLORS_LEN];
+	if (snprintf(settings, sizeof(settings), "%s", spec) >= (int) sizeof(settings))
+		return ERR_BADARG;
+
+	char *save;
+	for (char *s = strtok_r(settings, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+		char key[16];
+		double value;
+		if (sscanf(s, "%15[^=]=%lf", key, &value) != 2)
+			return ERR_BADARG;
+
+		if (!strcmp(key, "gamma") && value > 0)
+			gamma = value;
+		else if (!strcmp(key, "brightness") && value >= 0 && value <= 1)
+			brightness = value;
+		else if (!strcmp(key, "contrast") && value >= 0)
+			contrast = value;
+		else if (!strcmp(key, "levels") && value >= 2 && value <= 256)
+			levels = value;
+		else if (!strcmp(key, "palette") && value >= 2 && value <= PALETTE_MAX)
+			colors = value;
+		else if (!strcmp(key, "dither") && value >= 0 && value <= 1)
+			strength = value;
+		else
+			return ERR_BADARG;
+	}
+
+	/* a palette has levels of its own */
+	if (colors && levels != 256)
+		return ERR_BADARG;
+
+	free(palette);
+	palette = NULL;
+	if (colors) {
+		palette = malloc(sizeof(*palette));
+		if (palette == NULL)
+			return ERR_ALLOC;
+		palette->want = colors;
+		palette->size = 0;
+	}
+
+	/* dithered levels are rounded to after the tables */
+	const bool dithered = strength > 0 && (colors || levels != 256);
+	const int rounded = dithered ? 256 : levels;
+	for (int v = 0; v < 256; v++) {
+		double x = (v / 255.0 - 0.5) * contrast + 0.5;
+		x = x < 0 ? 0 : x > 1 ? 1 : x;
+		x = pow(x, gamma) * brightness;
+		x = round(x * (rounded - 1)) / (rounded - 1);
+
+		const uint32_t out = round(x * 255);
+		lut[0][v] = out << 16;
+		lut[1][v] = out << 8;
+		lut[2][v] = out;
+		quantum[v] = round(round(v / 255.0 * (levels - 1)) / (levels - 1) * 255);
+	}
+
+	/*
+	 * a 4x4 Bayer matrix, scaled to just under a step between levels, or
+	 * between colors of an evenly spread palette of that size
+	 */
+	static const int bayer[4][4] = {
+		{0, 8, 2, 10},
+		{12, 4, 14, 6},
+		{3, 11, 1, 9},
+		{15, 7, 13, 5},
+	};
+	const double steps = colors ? cbrt(colors) - 1 : levels - 1;
+	const double step = steps < 1 ? 255 : 255 / steps;
+	for (int y = 0; y < 4; y++)
+		for (int x = 0; x < 4; x++)
+			dither[y][x] = dithered ? round(((bayer[y][x] + 0.5) / 16 - 0.5) * step * strength) : 0;
+
+	transform = gamma != 1 || brightness != 1 || contrast != 1 || rounded != 256;
+	quantize = colors || dithered;
+	dithering = dithered;
+	return 0;
+}
+
+/*
+ * split_box sorts the n colors at box by their widest channel and returns how
+ * many go into the lower half, splitting at the median
+ */
+static int split_box(uint32_t *box, int n, uint32_t *scratch)
+{
+	uint32_t lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+	for (int k = 0; k < n; k++) {
+		for (int c = 0; c < 3; c++) {
+			const uint32_t v = box[k] >> (16 - 8 * c) & 0xff;
+			lo[c] = v < lo[c] ? v : lo[c];
+			hi[c] = v > hi[c] ? v : hi[c];
+		}
+	}
+	int widest = 1;
+	for (int c = 0; c < 3; c++)
+		if (hi[c] - lo[c] > hi[widest] - lo[widest])
+			widest = c;
+	const int shift = 16 - 8 * widest;
+
+	/* counting sort, values are bytes */
+	int start[257] = {0};
+	for (int k = 0; k < n; k++)
+		start[(box[k] >> shift & 0xff) + 1]++;
+	for (int v = 0; v < 256; v++)
+		start[v + 1] += start[v];
+	for (int k = 0; k < n; k++)
+		scratch[start[box[k] >> shift & 0xff]++] = box[k];
+	memcpy(box, scratch, n * sizeof(*box));
+	return n / 2;
+}
+
+/* range returns how far apart the n colors at box are in their widest channel */
+static int range(const uint32_t *box, int n)
+{
+	int widest = 0;
+	for (int c = 0; c < 3; c++) {
+		int lo = 255, hi = 0;
+		for (int k = 0; k < n; k++) {
+			const int v = box[k] >> (16 - 8 * c) & 0xff;
+			lo = v < lo ? v : lo;
+			hi = v > hi ? v : hi;
+		}
+		widest = hi - lo > widest ? hi - lo : widest;
+	}
+	return widest;
+}
+
+/*
+ * pick_palette picks palette->want colors by median cut of a sample of fb,
+ * which is in the canvas's size, after the tables. Returns 0 on success.
+ */
+static int pick_palette(const uint32_t * const fb)
+{
+	const uint32_t area = canvas_w * canvas_h;
+	const uint32_t stride = area / PALETTE_SAMPLES + 1;
+	const int n = (area + stride - 1) / stride;
+
+	uint32_t *samples = malloc(2 * n * sizeof(*samples));
+	if (samples == NULL)
+		return ERR_ALLOC;
+	for (int k = 0; k < n; k++) {
+		const uint32_t px = fb[k * stride];
+		samples[k] = transform ? lut[0][px >> 16 & 0xff] | lut[1][px >> 8 & 0xff] | lut[2][px & 0xff] : px & 0x00ffffff;
+	}
+
+	/* keep splitting the box that spans the most */
+	struct {
+		int start, len, range;
+	} boxes[PALETTE_MAX] = {{0, n, range(samples, n)}};
+	int num_boxes = 1;
+	while (num_boxes < palette->want) {
+		int widest = 0;
+		for (int b = 1; b < num_boxes; b++)
+			if (boxes[b].range > boxes[widest].range)
+				widest = b;
+		if (boxes[widest].range == 0)
+			break;
+
+		uint32_t *box = samples + boxes[widest].start;
+		const int len = boxes[widest].len;
+		const int lower = split_box(box, len, samples + n);
+		boxes[widest].len = lower;
+		boxes[widest].range = range(box, lower);
+		boxes[num_boxes].start = boxes[widest].start + lower;
+		boxes[num_boxes].len = len - lower;
+		boxes[num_boxes].range = range(box + lower, len - lower);
+		num_boxes++;
+	}
+
+	/* each box becomes its average color */
+	for (int b = 0; b < num_boxes; b++) {
+		uint64_t sum[3] = {0};
+		const uint32_t *box = samples + boxes[b].start;
+		for (int k = 0; k < boxes[b].len; k++)
+			for (int c = 0; c < 3; c++)
+				sum[c] += box[k] >> (16 - 8 * c) & 0xff;
+		const int len = boxes[b].len;
+		palette->r[b] = (sum[0] + len / 2) / len;
+		palette->g[b] = (sum[1] + len / 2) / len;
+		palette->b[b] = (sum[2] + len / 2) / len;
+		palette->color[b] = palette->r[b] << 16 | palette->g[b] << 8 | palette->b[b];
+	}
+	free(samples);
+
+	/* lanes past the end are out of reach */
+	for (int b = num_boxes; b < PALETTE_MAX; b++) {
+		palette->r[b] = palette->g[b] = palette->b[b] = 1024;
+		palette->color[b] = 0;
+	}
+	palette->size = num_boxes;
+	memset(palette->inverse, 0xff, sizeof(palette->inverse));
+	return 0;
+}
+
+void pf_verify(int rate)
+{
+	/* nothing to read from */
+	if (!num_candidates)
+		return;
+	if (relay) {
+		fprintf(stderr, "DEBUG: the relay can't be read back from, pass -V to it instead\n");
+		return;
+	}
+
+	/* the reads race the addresses like the pool did */
+	int slots[VERIFY_CONNS], fds[VERIFY_CONNS], picked[VERIFY_CONNS];
+	for (int k = 0; k < VERIFY_CONNS; k++)
+		slots[k] = k;
+	pf_connect_slots(slots, fds, picked, VERIFY_CONNS);
+
+	for (int k = 0; k < VERIFY_CONNS; k++) {
+		probes[k].fd = fds[k];
+		probes[k].connecting = false;
+		probes[k].candidate = fds[k] >= 0 ? picked[k] : k;
+		probes[k].backoff = BACKOFF_MIN;
+		probes[k].retry_at = 0;
+	}
+	verify_rate = rate;
+	verify_last = pf_now_ms();
+}
+
+/*
+ * probe_fail closes a read connection, forgets its reads, and schedules a
+ * reconnect to the next address
+ */
+static void probe_fail(struct pf_probe *p, int64_t now)
+{
+	if (p->fd >= 0) {
+		close(p->fd);
+		p->fd = -1;
+	}
+	p->connecting = false;
+	p->candidate++;
+	p->len = 0;
+	p->out_len = 0;
+	p->in_len = 0;
+	p->retry_at = now + p->backoff;
+	p->backoff = p->backoff * 2 < BACKOFF_MAX ? p->backoff * 2 : BACKOFF_MAX;
+}
+
+/* probe_tick moves a read connection that isn't up along, without blocking */
+static void probe_tick(struct pf_probe *p, int64_t now)
+{
+	if (p->fd < 0) {
+		if (now < p->retry_at)
+			return;
+
+		bool done;
+		p->fd = pf_attempt(&candidates[p->candidate % num_candidates], &done);
+		if (p->fd < 0) {
+			probe_fail(p, now);
+			return;
+		}
+		p->connecting = !done;
+		p->connect_start = now;
+		if (done)
+			p->backoff = BACKOFF_MIN;
+		return;
+	}
+
+	if (!p->connecting)
+		return;
+
+	struct pollfd pfd = { .fd = p->fd, .events = POLLOUT };
+	if (poll(&pfd, 1, 0) != 1) {
+		if (now - p->connect_start >= connect_timeout)
+			probe_fail(p, now);
+		return;
+	}
+
+	int err;
+	socklen_t errlen = sizeof(err);
+	if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+		probe_fail(p, now);
+		return;
+	}
+	p->connecting = false;
+	p->backoff = BACKOFF_MIN;
+}
+
+/*
+ * settled returns true if dirty tile t was last sent long enough before
+ * cutoff to have reached the server, and hasn't changed since.
+ */
+static bool settled(int t, int64_t cutoff)
+{
+	return dirty[t].state == DIRTY_CLEAN && dirty[t].sent_at <= cutoff;
+}
+
+/* verifiable returns true if pixel i is settled and the server should show a known color */
+static bool verifiable(uint32_t i, int64_t cutoff)
+{
+	return shadow[i] <= 0x00ffffff && settled((i / canvas_w >> DIRTY_SHIFT) * dirty_x + (i % canvas_w >> DIRTY_SHIFT), cutoff);
+}
+
+/*
+ * verify_sample picks a pixel to read back: every other one from a tile that
+ * was painted over lately and has been repainted since, the rest from all
+ * over the canvas. Returns false if none of the few it tried is verifiable.
+ */
+static bool verify_sample(int64_t cutoff, uint32_t *ret)
+{
+	const uint32_t area = canvas_w * canvas_h;
+	for (int tries = 0; tries < 8; tries++) {
+		verify_seed ^= verify_seed << 13;
+		verify_seed ^= verify_seed >> 17;
+		verify_seed ^= verify_seed << 5;
+
+		uint32_t i;
+		const int t = num_hot ? (int) hot[verify_seed % num_hot] : -1;
+		if (t >= 0 && verify_seed & 1 && settled(t, cutoff)) {
+			const int tx = (t % dirty_x) << DIRTY_SHIFT;
+			const int ty = (t / dirty_x) << DIRTY_SHIFT;
+			const int w = canvas_w - tx < (1 << DIRTY_SHIFT) ? canvas_w - tx : 1 << DIRTY_SHIFT;
+			const int h = canvas_h - ty < (1 << DIRTY_SHIFT) ? canvas_h - ty : 1 << DIRTY_SHIFT;
+			i = (ty + (verify_seed >> 8) % h) * canvas_w + tx + (verify_seed >> 20) % w;
+		} else {
+			i = verify_seed % area;
+		}
+
+		if (verifiable(i, cutoff)) {
+			*ret = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * repaint forgets what pixelflut shows in dirty tile t, since another client
+ * painted over part of it, and queues all of it ahead of everything else.
+ */
+static void repaint(int t, int64_t now)
+{
+	const int tx = (t % dirty_x) << DIRTY_SHIFT;
+	const int ty = (t / dirty_x) << DIRTY_SHIFT;
+	const int w = canvas_w - tx < (1 << DIRTY_SHIFT) ? canvas_w - tx : 1 << DIRTY_SHIFT;
+	const int h = canvas_h - ty < (1 << DIRTY_SHIFT) ? canvas_h - ty : 1 << DIRTY_SHIFT;
+	for (int y = ty; y < ty + h; y++)
+		for (int x = tx; x < tx + w; x++)
+			if (shadow[y * canvas_w + x] <= 0x00ffffff)
+				shadow[y * canvas_w + x] = SHADOW_LOST;
+
+	dirty[t].overwritten = true;
+	damage(tx, tx + w, ty, ty + h, now);
+
+	int k;
+	for (k = 0; k < num_hot && hot[k] != (uint32_t) t; k++);
+	if (k == num_hot && num_hot < VERIFY_HOT)
+		hot[num_hot++] = t;
+	else if (k == num_hot)
+		hot[verify_seed % VERIFY_HOT] = t;
+}
+
+/*
+ * verify_answer compares a reply of pixelflut, "PX x y rrggbb", with the
+ * shadow canvas. Reads asked before the one it answers got lost somehow and
+ * are dropped.
+ */
+static void verify_answer(struct pf_probe *p, const char *line, int64_t now)
+{
+	int x, y;
+	char hex[9];
+	if (sscanf(line, "PX %d %d %8[0-9a-fA-F]", &x, &y, hex) != 3)
+		return;
+	x -= offset_x;
+	y -= offset_y;
+	if (x < 0 || y < 0 || x % upscale || y % upscale)
+		return;
+	x /= upscale;
+	y /= upscale;
+	if (x >= canvas_w || y >= canvas_h)
+		return;
+
+	const uint32_t i = y * canvas_w + x;
+	int k;
+	for (k = 0; k < p->len && p->asked[(p->head + k) % VERIFY_WINDOW] != i; k++);
+	if (k == p->len)
+		return;
+
+	const int64_t asked_at = p->asked_at[(p->head + k) % VERIFY_WINDOW];
+	p->head = (p->head + k + 1) % VERIFY_WINDOW;
+	p->len -= k + 1;
+
+	/* it may have been sent again while the read was on its way */
+	if (!verifiable(i, asked_at - VERIFY_SETTLE - backlog_ms))
+		return;
+
+	/* some servers answer with alpha, rrggbbaa */
+	uint32_t color = strtoul(hex, NULL, 16);
+	if (strlen(hex) == 8)
+		color >>= 8;
+	STATS_ADD(pixels_verified, 1);
+
+	const int t = (y >> DIRTY_SHIFT) * dirty_x + (x >> DIRTY_SHIFT);
+	if (color != shadow[i]) {
+		STATS_ADD(pixels_overwritten, 1);
+		repaint(t, now);
+		return;
+	}
+
+	/* intact again: back to sampling it like the rest */
+	for (k = 0; k < num_hot; k++)
+		if (hot[k] == (uint32_t) t)
+			hot[k] = hot[--num_hot];
+}
+
+/* verify_read takes every reply that has arrived on p. Returns false if p dropped. */
+static bool verify_read(struct pf_probe *p, int64_t now)
+{
+	for (;;) {
+		ssize_t n = recv(p->fd, p->in + p->in_len, VERIFY_INLEN - p->in_len, MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n <= 0)
+			return false;
+		p->in_len += n;
+
+		char *line = p->in, *end = p->in + p->in_len, *nl;
+		while ((nl = memchr(line, '\n', end - line))) {
+			*nl = '\0';
+			verify_answer(p, line, now);
+			line = nl + 1;
+		}
+
+		/* keep the start of the last reply; a line this long is garbage */
+		p->in_len = end - line < VERIFY_INLEN ? end - line : 0;
+		memmove(p->in, line, p->in_len);
+	}
+}
+
+/* verify_flush writes as many of the reads asked on p as its socket takes */
+static bool verify_flush(struct pf_probe *p)
+{
+	while (p->out_len) {
+		ssize_t n = send(p->fd, p->out, p->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		p->out_len -= n;
+		memmove(p->out, p->out + n, p->out_len);
+	}
+	return true;
+}
+
+/*
+ * verify_tick reads back pixels pixelflut should be showing, verify_rate a
+ * second, pipelined over the read connections, and repaints tiles that other
+ * clients painted over. It never blocks.
+ */
+static void verify_tick(int64_t now)
+{
+	verify_budget += (now - verify_last) * verify_rate / 1000.0;
+	if (verify_budget > VERIFY_CONNS * VERIFY_WINDOW)
+		verify_budget = VERIFY_CONNS * VERIFY_WINDOW;
+	verify_last = now;
+
+	for (int k = 0; k < VERIFY_CONNS; k++) {
+		struct pf_probe *p = &probes[k];
+		probe_tick(p, now);
+		if (p->fd >= 0 && !p->connecting && !verify_read(p, now))
+			probe_fail(p, now);
+	}
+	if (shadow == NULL)
+		return;
+
+	/* ask the connection with the fewest reads in flight */
+	const int64_t cutoff = now - VERIFY_SETTLE - backlog_ms;
+	while (verify_budget >= 1) {
+		struct pf_probe *p = NULL;
+		for (int k = 0; k < VERIFY_CONNS; k++)
+			if (probes[k].fd >= 0 && !probes[k].connecting && (p == NULL || probes[k].len < p->len))
+				p = &probes[k];
+		if (p == NULL || p->len == VERIFY_WINDOW)
+			break;
+
+		uint32_t i;
+		if (!verify_sample(cutoff, &i))
+			break;
+
+		const int slot = (p->head + p->len++) % VERIFY_WINDOW;
+		p->asked[slot] = i;
+		p->asked_at[slot] = now;
+
+		char *q = p->out + p->out_len;
+		*q++ = 'P';
+		*q++ = 'X';
+		*q++ = ' ';
+		q += put_uint(q, i % canvas_w * upscale + offset_x);
+		*q++ = ' ';
+		q += put_uint(q, i / canvas_w * upscale + offset_y);
+		*q++ = '\n';
+		p->out_len = q - p->out;
+		verify_budget--;
+	}
+
+	for (int k = 0; k < VERIFY_CONNS; k++) {
+		struct pf_probe *p = &probes[k];
+		if (p->fd >= 0 && !p->connecting && !verify_flush(p))
+			probe_fail(p, now);
+	}
+}
+
+/*
+ * flickering returns true if pixel i would only go back to the color it had
+ * before, again, and counts what holding it saves.
+ */
+static bool flickering(uint32_t i, uint32_t color)
+{
+	if (toggles[i] < CALM_TOGGLES || color != previous[i])
+		return false;
+
+	char px[PX_MAXLEN];
+	STATS_ADD(pixels_calmed, 1);
+	STATS_ADD(bytes_calmed, encode_px(px, i % canvas_w, i / canvas_w, color) * upscale * upscale);
+	return true;
+}
+
+/*
+ * diff_tile appends the pixels of the w x h tile at (x1, y1) that differ from
+ * the shadow canvas to out, going from position *cursor up to position to of
+ * its send order, but stopping after max pixels. Unless exact, pixels closer
+ * than threshold to the shadow canvas in every channel count as the same, and
+ * in calm mode flickering pixels are held; either sets *inexact. Advances
+ * *cursor and returns how many pixels it appended, or -1 if out of memory.
+ */
+static int diff_tile(const uint32_t * const fb, int x1, int y1, int w, int h, int *cursor, int to, int max, bool exact, bool *inexact, const uint32_t bgcolor, uint32_t *out)
+{
+	static __thread int skip_reblit = 0;
+
+	const bool ignore_bgcolor = (bgcolor == PF_NO_BGCOLOR);
+
+	/* over UDP, reblits also make up for lost datagrams */
+	const bool reblit = !ignore_bgcolor || udp;
+	const bool hold = calm && !exact;
+	const int near = exact ? 0 : threshold;
+	const bool skip_blank = prefilled && !ignore_bgcolor;
+
+	const uint32_t *order = order_get(send_order, w, h);
+	if (order == NULL)
+		return -1;
+
+	int n = 0, k = *cursor;
+
+	/*
+	 * exact comparisons are cheap enough one by one, background included:
+	 * gathering lanes only pays for itself with masks to compute
+	 */
+	if (!near && !skip_blank) {
+		for (; k < to && n < max; k++) {
+			uint32_t i = (y1 + (order[k] >> 16)) * canvas_w + x1 + (order[k] & 0xffff);
+			skip_reblit = (skip_reblit + 1) % REBLIT_FREQUENCY;
+
+			uint32_t color = look_up(fb[i], i);
+
+			/* skip redundant pixels. sometimes reblit anyway if skip_reblit reaches zero */
+			if (shadow[i] == color && (!reblit || color == bgcolor || skip_reblit || (hold && toggles[i])))
+				continue;
+
+			if (hold && flickering(i, color)) {
+				*inexact = true;
+				continue;
+			}
+
+			out[n++] = i;
+		}
+		*cursor = k;
+		return n;
+	}
+
+	/*
+	 * SIMD has signed byte comparisons only, so channels are compared with
+	 * their sign bit flipped
+	 */
+	const pf_lane_bytes sign = (pf_lane_bytes) {0} + INT8_MIN;
+	const pf_lane_bytes far = ((pf_lane_bytes) {0} + (int8_t) near) ^ sign;
+	const pf_lanes background = (pf_lanes) {0} + bgcolor;
+	const pf_lanes unknown = (pf_lanes) {0} + SHADOW_UNKNOWN;
+	while (k < to && n < max) {
+		const int lanes = to - k < DIFF_LANES ? to - k : DIFF_LANES;
+
+		/* gather the next pixels in send order */
+		uint32_t index[DIFF_LANES];
+		pf_lanes color = {0}, was = {0};
+		for (int l = 0; l < lanes; l++) {
+			index[l] = (y1 + (order[k + l] >> 16)) * canvas_w + x1 + (order[k + l] & 0xffff);
+			color[l] = look_up(fb[index[l]], index[l]);
+			was[l] = shadow[index[l]];
+		}
+
+		/*
+		 * compare them all at once, channel by channel. SHADOW_* values
+		 * are always far, as near is at most PF_THRESHOLD_MAX.
+		 */
+		const pf_lanes same = (pf_lanes) (color == was);
+		pf_lanes close = same;
+		if (near) {
+			const pf_lane_bytes a = (pf_lane_bytes) color, b = (pf_lane_bytes) was;
+			const pf_lane_ubytes above = (pf_lane_ubytes) ((a ^ sign) > (b ^ sign));
+
+			/* the distance wraps, so it's taken unsigned */
+			const pf_lane_ubytes ua = (pf_lane_ubytes) color, ub = (pf_lane_ubytes) was;
+			const pf_lane_bytes distance = (pf_lane_bytes) (((ua - ub) & above) | ((ub - ua) & ~above));
+			close |= (pf_lanes) ((pf_lanes) (pf_lane_bytes) ((distance ^ sign) >= far) == 0);
+		}
+
+		/* background the server has had from the start */
+		pf_lanes blank = {0};
+		if (skip_blank)
+			blank = (pf_lanes) ((color == background) & (was == unknown));
+
+		unsigned same_bits = 0, close_bits = 0, blank_bits = 0;
+		for (int l = 0; l < DIFF_LANES; l++) {
+			same_bits |= (same[l] & 1) << l;
+			close_bits |= (close[l] & 1) << l;
+			blank_bits |= (blank[l] & 1) << l;
+		}
+
+		/* usually, none of them needs a closer look */
+		const unsigned all = (1u << lanes) - 1;
+		if (((same_bits | blank_bits) & all) == all && (!reblit || skip_reblit + lanes < REBLIT_FREQUENCY)) {
+			k += lanes;
+			skip_reblit += lanes;
+			continue;
+		}
+
+		for (int l = 0; l < lanes && n < max; l++, k++) {
+			skip_reblit = (skip_reblit + 1) % REBLIT_FREQUENCY;
+
+			if (blank_bits >> l & 1)
+				continue;
+
+			/* skip redundant pixels. sometimes reblit anyway if skip_reblit reaches zero */
+			if (close_bits >> l & 1 && (!reblit || color[l] == bgcolor || skip_reblit || (hold && toggles[index[l]]))) {
+				if (!(same_bits >> l & 1))
+					*inexact = true;
+				continue;
+			}
+
+			if (hold && flickering(index[l], color[l])) {
+				*inexact = true;
+				continue;
+			}
+
+			out[n++] = index[l];
+		}
+	}
+	*cursor = k;
+	return n;
+}
+
+/* shown records that pixelflut shows color at pixel i from now on */
+static void shown(uint32_t i, uint32_t color)
+{
+	if (calm) {
+		toggles[i] = color == previous[i] ? toggles[i] + (toggles[i] < UINT8_MAX) : 0;
+		previous[i] = shadow[i];
+	}
+	shadow[i] = color;
+}
+
+/*
+ * write_shm puts the first n changed pixels straight into the shared canvas,
+ * then rings the doorbell if a consumer is waiting for it. Returns n.
+ */
+static int write_shm(const uint32_t * const fb, int n)
+{
+	for (int k = 0; k < n; k++) {
+		uint32_t i = changed[k];
+		uint32_t color = look_up(fb[i], i);
+		shm->pixels[i] = color;
+		shown(i, color);
+	}
+	if (!n)
+		return 0;
+	STATS_ADD(bytes, n * sizeof(shm->pixels[0]));
+
+	__atomic_add_fetch(&shm->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&shm->waiters, __ATOMIC_SEQ_CST)) {
+		syscall(SYS_futex, &shm->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		STATS_ADD(syscalls, 1);
+	}
+	return n;
+}
+
+/* put_varint writes v as a LEB128 varint to p and returns the end */
+static uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = v | 0x80;
+	*p++ = v;
+	return p;
+}
+
+/*
+ * write_relay packs the first n changed pixels into blocks for the relay, see
+ * struct pf_relay_block, flushing the connection whenever the next block
+ * might not fit. Time spent flushing is added to send_ns. Returns how many
+ * were packed; the others are queued for replay.
+ */
+static int write_relay(const uint32_t * const fb, int n, uint64_t *send_ns)
+{
+	static __thread uint8_t raw[RELAY_PIXELS * RELAY_PX_MAXLEN];
+
+	int packed = 0;
+	while (packed < n) {
+		struct pf_conn *c = next_conn();
+		while (c && (c->len + RELAY_BLOCK_MAX > OUTBUF_LEN || c->num_buffered + RELAY_PIXELS > OUTBUF_PIXELS)) {
+			uint64_t t = stats_now();
+			bool ok = flush(c);
+			*send_ns += stats_now() - t;
+			if (!ok)
+				c = next_conn();
+			else
+				break;
+		}
+
+		/* the relay is down; try again next time */
+		if (c == NULL) {
+			for (int k = packed; k < n; k++)
+				mark_dirty(changed[k]);
+			break;
+		}
+
+		const int end = n - packed < RELAY_PIXELS ? n : packed + RELAY_PIXELS;
+		uint8_t *p = raw;
+		uint32_t last = 0;
+		for (int k = packed; k < end; k++) {
+			const uint32_t i = changed[k];
+			const uint32_t color = look_up(fb[i], i);
+			const int32_t delta = i - last;
+			p = put_varint(p, (uint32_t) delta << 1 ^ (uint32_t) (delta >> 31));
+			*p++ = color >> 16;
+			*p++ = color >> 8;
+			*p++ = color;
+			last = i;
+			c->buffered[c->num_buffered++] = i;
+			shown(i, color);
+		}
+
+		struct pf_relay_block b = {
+			.magic = PF_RELAY_MAGIC,
+			.width = canvas_w,
+			.height = canvas_h,
+			.offset_x = offset_x,
+			.offset_y = offset_y,
+			.raw_len = p - raw,
+		};
+		uint8_t *out = (uint8_t *) c->buf + c->len;
+		b.packed_len = lz_compress(raw, b.raw_len, out + sizeof(b));
+		memcpy(out, &b, sizeof(b));
+		__atomic_store_n(&c->len, c->len + sizeof(b) + b.packed_len, __ATOMIC_RELAXED);
+		packed = end;
+	}
+	return packed;
+}
+
+/*
+ * tile_pass returns where the pass of a dirty tile that starts at cursor
+ * ends. Passes end after 1/64, 1/16 and 1/4 of the tile, so every queued tile
+ * gets its coarse pixels out before any gets its fine ones.
+ */
+static int tile_pass(int cursor, int area)
+{
+	for (int shift = 6; shift > 0; shift -= 2)
+		if (cursor < area >> shift)
+			return area >> shift;
+	return area;
+}
+
+int pf_send(const uint32_t * const fb, uint32_t bgcolor)
+{
+	conns_tick();
+	if (autoscale)
+		pool_tick();
+	if (tiles)
+		tiles_tick();
+
+	const int64_t now = pf_now_ms();
+	if (verify_rate)
+		verify_tick(now);
+
+	/* the palette comes from the first frame */
+	if (palette && !palette->size) {
+		int err = pick_palette(fb);
+		if (err)
+			return err;
+	}
+
+	/* the background is compared with transformed colors, too */
+	if (bgcolor == PF_AUTO_BGCOLOR)
+		bgcolor = background(fb);
+	else if (bgcolor != PF_NO_BGCOLOR)
+		bgcolor = look_up(bgcolor, NOWHERE);
+
+	/* pixels lost to dropped connections are damage like any other */
+	for (int k = 0; k < num_replay; k++) {
+		uint32_t i = replay[k];
+		shadow[i] = SHADOW_LOST;
+		damage(i % canvas_w, i % canvas_w + 1, i / canvas_w, i / canvas_w + 1, now);
+	}
+	num_replay = 0;
+
+	trace_rect_begin();
+	uint64_t t_diff = stats_now();
+
+	/* parked tiles whose time has come get back in line */
+	for (int k = 0; k < num_parked;) {
+		if (tile_parked_until(&dirty[parked[k]]) > now) {
+			k++;
+			continue;
+		}
+		queue_push(parked[k], now);
+		parked[k] = parked[--num_parked];
+	}
+
+	/*
+	 * diff stage: collect the pixels we have to send from the dirty tiles,
+	 * in order of priority. Each tile gets a turn of DRR_QUANTUM pixels plus
+	 * what it didn't use of earlier turns, so tiles with lots of changes
+	 * don't starve the others.
+	 */
+	int num_changed = 0, considered = 0;
+	int x1 = canvas_w, x2 = 0, y1 = canvas_h, y2 = 0;
+	while (num_queued && considered < SEND_SLICE) {
+		const int t = queue_pop();
+
+		struct pf_dirty *d = &dirty[t];
+		if (tile_parked_until(d) > now) {
+			parked[num_parked++] = t;
+			continue;
+		}
+
+		const int tx = (t % dirty_x) << DIRTY_SHIFT;
+		const int ty = (t / dirty_x) << DIRTY_SHIFT;
+		const int w = canvas_w - tx < (1 << DIRTY_SHIFT) ? canvas_w - tx : 1 << DIRTY_SHIFT;
+		const int h = canvas_h - ty < (1 << DIRTY_SHIFT) ? canvas_h - ty : 1 << DIRTY_SHIFT;
+		const int end = tile_pass(d->cursor, w * h);
+
+		if (!d->cursor) {
+			d->walk_at = now;
+			if (d->state == DIRTY_CONVERGE)
+				d->inexact = false;
+		}
+		if (d->deficit < DIRTY_AREA)
+			d->deficit += DRR_QUANTUM;
+
+		int cursor = d->cursor;
+		const bool exact = d->state == DIRTY_CONVERGE;
+		int n = diff_tile(fb, tx, ty, w, h, &cursor, end, d->deficit, exact, &d->inexact, bgcolor, changed + num_changed);
+		if (n < 0)
+			return ERR_ALLOC;
+		num_changed += n;
+		considered += cursor - d->cursor;
+		d->deficit -= n;
+		if (n)
+			d->sent_at = now;
+
+		x1 = tx < x1 ? tx : x1;
+		y1 = ty < y1 ? ty : y1;
+		x2 = tx + w > x2 ? tx + w : x2;
+		y2 = ty + h > y2 ? ty + h : y2;
+
+		d->cursor = cursor;
+		if (d->cursor == w * h) {
+			d->cursor = 0;
+			d->deficit = 0;
+			d->overwritten = false;
+			if (d->state == DIRTY_AGAIN) {
+				d->state = DIRTY_QUEUED;
+			} else if (d->inexact) {
+				/* wait until it's quiet, then send exact colors */
+				d->state = DIRTY_CONVERGE;
+				parked[num_parked++] = t;
+				continue;
+			} else {
+				/* quiet and exact: flickering is over */
+				if (calm && d->state == DIRTY_CONVERGE)
+					for (int y = ty; y < ty + h; y++)
+						memset(toggles + y * canvas_w + tx, 0, w);
+				d->state = DIRTY_CLEAN;
+				continue;
+			}
+		}
+		queue_push(t, now);
+	}
+	const int num_damaged = num_changed;
+
+	uint64_t t_encode = stats_now();
+	stats_stage_add(STAGE_DIFF, t_encode - t_diff, considered);
+
+	/* encode stage: format commands into the connection buffers, round-robin or by tile */
+	uint64_t send_ns = 0;
+	int num_sent = 0;
+	if (shm) {
+		/* or, with a shared canvas, write them there; nothing is left for the pool */
+		num_sent = write_shm(fb, num_changed);
+		num_changed = 0;
+	} else if (relay) {
+		/* or pack them for the relay */
+		num_sent = write_relay(fb, num_changed, &send_ns);
+		num_changed = 0;
+	}
+	for (int k = 0; k < num_changed; k++) {
+		uint32_t i = changed[k];
+		int x = i % canvas_w, y = i / canvas_w;
+
+		struct pf_tile *tile = NULL;
+		if (tiles)
+			tile = &tiles[(y >> tile_shift_y) * tiles_x + (x >> tile_shift_x)];
+
+		struct pf_conn *c = tile ? tile_conn(tile) : next_conn();
+		while (c && c->len > OUTBUF_LEN - PX_MAXLEN * upscale * upscale) {
+			uint64_t t = stats_now();
+			bool ok = flush(c);
+			send_ns += stats_now() - t;
+			if (!ok)
+				c = tile ? tile_conn(tile) : next_conn();
+			else
+				break;
+		}
+
+		/* the whole pool is down; try again next time */
+		if (c == NULL) {
+			mark_dirty(i);
+			continue;
+		}
+
+		uint32_t color = look_up(fb[i], i);
+		int n = upscale > 1 ? encode_block(c->buf + c->len, x, y, color) : encode_px(c->buf + c->len, x, y, color);
+		__atomic_store_n(&c->len, c->len + n, __ATOMIC_RELAXED);
+		if (tile) {
+			tile->work++;
+			conns[tile_holder(tile)].load++;
+			if (tile->next >= 0)
+				tile->mark = c->bytes + c->len;
+		}
+		c->buffered[c->num_buffered++] = i;
+		shown(i, color);
+		num_sent++;
+	}
+
+	/* wakeups that sent nothing aren't rects */
+	if (num_sent)
+		trace_rect_encoded(x1, x2, y1, y2);
+	uint64_t t_send = stats_now();
+	stats_stage_add(STAGE_ENCODE, t_send - t_encode - send_ns, num_sent);
+
+	/* send stage: drain every connection buffer */
+	for (int i = 0; i < num_conns; i++)
+		if (conns[i].state == CONN_UP && conns[i].len)
+			flush(&conns[i]);
+
+	stats_stage_add(STAGE_SEND, stats_now() - t_send + send_ns, num_sent);
+	if (num_sent)
+		trace_rect_sent();
+
+	STATS_ADD(pixels_considered, considered);
+	STATS_ADD(pixels_skipped, considered - num_damaged);
+	STATS_ADD(pixels_sent, num_sent);
+
+	backlog_tick(considered);
+	return 0;
+}
+
+int pf_num_conns(void)
+{
+	int n = 0;
+	pthread_mutex_lock(&views_lock);
+	for (const struct pf_view *v = views; v; v = v->next)
+		n += __atomic_load_n(v->num_conns, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&views_lock);
+	return n;
+}
+
+void pf_conn_stats(int i, struct pf_conn_stats *ret)
+{
+	memset(ret, 0, sizeof(*ret));
+
+	/* connections are numbered through the pools of all threads */
+	pthread_mutex_lock(&views_lock);
+	const struct pf_conn *c = NULL;
+	for (const struct pf_view *v = views; v && c == NULL; v = v->next) {
+		int n = __atomic_load_n(v->num_conns, __ATOMIC_RELAXED);
+		if (i < n)
+			c = &(*v->conns)[i];
+		i -= n;
+	}
+	if (c == NULL) {
+		/* the pool shrank in the meantime */
+		pthread_mutex_unlock(&views_lock);
+		return;
+	}
+
+	ret->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+	ret->buffered = __atomic_load_n(&c->len, __ATOMIC_RELAXED);
+	ret->up = __atomic_load_n(&c->state, __ATOMIC_RELAXED) == CONN_UP;
+
+	int unsent;
+	ret->unsent = ioctl(c->fd, SIOCOUTQ, &unsent) ? 0 : unsent;
+	ret->sndbuf = get_sndbuf(c->fd);
+	pthread_mutex_unlock(&views_lock);
+}
+
+void pf_close(void)
+{
+	view_unregister();
+
+	for (int i = 0; i < pool_slots; i++) {
+		if (conns[i].fd >= 0)
+			close(conns[i].fd);
+		for (int b = 0; b < ZEROCOPY_BUFS; b++)
+			if (conns[i].out[b].data)
+				munmap(conns[i].out[b].data, OUTBUF_LEN);
+	}
+	num_conns = 0;
+	pool_max = 0;
+	pool_slots = 0;
 
 	if (conns) {
 		free(conns);
 		conns = NULL;
 	}
+
+	if (shadow) {
+		free(shadow);
+		shadow = NULL;
+	}
+
+	if (replay) {
+		free(replay);
+		replay = NULL;
+		num_replay = 0;
+	}
+
+	if (tiles) {
+		free(tiles);
+		tiles = NULL;
+		num_tiles = 0;
+	}
+
+	if (candidates) {
+		free(candidates);
+		candidates = NULL;
+		num_candidates = 0;
+	}
+
+	if (changed) {
+		free(changed);
+		changed = NULL;
+	}
+
+	if (dirty) {
+		free(dirty);
+		dirty = NULL;
+	}
+
+	if (buckets[0].ring) {
+		free(buckets[0].ring);
+		buckets[0].ring = NULL;
+		num_queued = 0;
+	}
+
+	if (parked) {
+		free(parked);
+		parked = NULL;
+		num_parked = 0;
+	}
+
+	free(previous);
+	previous = NULL;
+	free(toggles);
+	toggles = NULL;
+	free(block_x);
+	block_x = NULL;
+	free(block_y);
+	block_y = NULL;
+
+	if (shm) {
+		munmap(shm, shm_len);
+		shm = NULL;
+	}
+	if (shm_fd >= 0) {
+		close(shm_fd);
+		shm_fd = -1;
+	}
+	relay = false;
+
+	for (int k = 0; verify_rate && k < VERIFY_CONNS; k++) {
+		if (probes[k].fd >= 0)
+			close(probes[k].fd);
+		probes[k].fd = -1;
+	}
+	verify_rate = 0;
+	num_hot = 0;
+
+	order_free();
 }
 
 /* vi: set ts=8 sts=8 sw=8 noet: */
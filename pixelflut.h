@@ -1,19 +1,108 @@
 #pragma once
 
+#include <stdbool.h>	/* bool */
 #include <stdint.h>	/* uint16_t */
 
+#include "order.h"	/* enum order */
+
 #define PF_NO_BGCOLOR 0x80000000
+#define PF_AUTO_BGCOLOR 0x40000000
+
+/* "pfsh", once a struct pf_shm is set up */
+#define PF_SHM_MAGIC 0x68736670
+
+/*
+ * struct pf_shm is the layout of the file behind a shm:PATH target. seq is
+ * bumped after each batch of pixels; consumers that want to sleep until then
+ * count themselves in waiters and FUTEX_WAIT on seq.
+ */
+struct pf_shm {
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	uint32_t seq;
+	uint32_t waiters;
+	uint32_t pixels[];	/* 0x00RRGGBB, row by row */
+};
+
+/* "pfrl", heading every block sent to a relay:HOST target */
+#define PF_RELAY_MAGIC 0x6c726670
+
+/* bytes a block sent to a relay unpacks to at most */
+#define PF_RELAY_RAW_MAX 65536
+
+/*
+ * struct pf_relay_block heads each block of pixels sent to a relay:HOST
+ * target, in little endian. It's followed by packed_len bytes in the LZ4
+ * block format (see lz.h) that unpack to raw_len bytes: for every pixel, how
+ * far its index y * width + x is from the one before (from 0 for the first),
+ * zigzag-encoded as a LEB128 varint, then its color as r, g and b bytes. The
+ * relay places the canvas at offset_x, offset_y on its server.
+ */
+struct pf_relay_block {
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	int32_t offset_x;
+	int32_t offset_y;
+	uint32_t raw_len;
+	uint32_t packed_len;
+};
 
 struct pf_size {
 	int w;
 	int h;
 };
 
+/* how pixels are spread over the connection pool */
+enum pf_assign {
+	PF_ASSIGN_PIXELS,	/* round-robin, one pixel at a time */
+	PF_ASSIGN_TILES,	/* every 32x32 tile sticks to one connection */
+	PF_ASSIGN_BANDS,	/* every band of 8 rows sticks to one connection */
+	PF_ASSIGNS
+};
+
+extern const char * const pf_assign_names[PF_ASSIGNS];
+
+struct pf_conn_stats {
+	uint64_t bytes;		/* bytes accepted by the socket so far */
+	int buffered;		/* bytes encoded but not yet written */
+	int unsent;		/* bytes in the kernel send queue */
+	bool up;		/* false while reconnecting */
+	int sndbuf;		/* SO_SNDBUF */
+};
+
+/*
+ * The state behind the pf_* functions belongs to the calling thread, so each
+ * thread that calls pf_connect drives a pool and canvas of its own, and one
+ * process can drive several servers at once. Functions for metrics, which
+ * say so, cover the pools of all threads.
+ */
+
+/*
+ * pf_connect opens a pool of non-blocking tcp sockets to a running pixelflut
+ * server. All sockets connect concurrently, racing IPv6 and IPv4 addresses;
+ * if any socket hasn't connected after timeout_ms, the whole pool fails. If
+ * spread is true, the pool is spread across all addresses of host instead of
+ * preferring the first one that works. A host of unix:PATH connects to a
+ * unix socket instead, ignoring port. With shm:PATH, there's no pool at all:
+ * pf_canvas maps the file at PATH as a struct pf_shm, and pixels are written
+ * right into it for a server on the same machine. With relay:HOST, the pool
+ * is a single connection to kernelflut-relay, which gets compressed blocks of
+ * changed pixels (see struct pf_relay_block) instead of commands, and sends
+ * them on to the server with a pool of its own. Returns 0 on success.
+ */
+int pf_connect(int pool_size, char *host, int port, int timeout_ms, bool spread);
+
 /*
- * pf_connect opens a pool of tcp sockets to a running pixelflut server.
- * Returns 0 on success.
+ * pf_udp makes pf_connect open UDP sockets instead of TCP ones. Commands are
+ * packed into datagrams as large as the path MTU allows and sent in batches
+ * of many per syscall. With gso, the kernel cuts them from one buffer per
+ * batch, padded with empty lines that the server must ignore. Datagrams that
+ * get lost aren't sent again, but pixels are repainted every now and then,
+ * as with a background color. Call before pf_connect.
  */
-int pf_connect(int pool_size, char *host, int port);
+void pf_udp(bool gso);
 
 /* pf_size asks pixelflut for its current dimensions. Returns 0 on success. */
 int pf_size(struct pf_size *ret);
@@ -25,11 +114,169 @@ int pf_size(struct pf_size *ret);
 int pf_set(int x, int y, unsigned char r, unsigned char g, unsigned char b);
 
 /*
- * pf_set_buf tells pixelflut at fd to set a bunch of RGB32 pixels from fb. If
+ * pf_canvas allocates the shadow canvas, which remembers what pixelflut should
+ * be showing for a width x height framebuffer. Must be called after pf_connect
+ * and before pf_damage. Returns 0 on success.
+ */
+int pf_canvas(int width, int height);
+
+/*
+ * pf_offset places the canvas at (x, y) of the server's canvas, for a canvas
+ * that covers only part of it. Not for shm:PATH.
+ */
+void pf_offset(int x, int y);
+
+/* the largest factor pf_upscale takes */
+#define PF_UPSCALE_MAX 16
+
+/*
+ * pf_upscale shows each pixel of the canvas as a block of factor x factor
+ * pixels on the server, starting at the offset. Damage is still diffed pixel
+ * by pixel of the canvas; only the commands are multiplied. Not for shm:PATH
+ * or relay:HOST. Call before pf_canvas.
+ */
+void pf_upscale(int factor);
+
+/*
+ * pf_assign chooses how pixels are spread over the connection pool. With
+ * tiles or bands, all updates of an area go out in order on the same socket,
+ * and areas move between sockets only to balance pending work, after
+ * everything already sent for them has been acknowledged. Call before
+ * pf_canvas.
+ */
+void pf_assign(enum pf_assign mode);
+
+/*
+ * pf_order chooses the order in which the pixels of a rect are sent. The
+ * default, ORDER_INTERLEAVE, is cheap; the others make a large update look
+ * like the whole thing sooner, ORDER_MULTIRES most of all.
+ */
+void pf_order(enum order o);
+
+/*
+ * pf_calm holds pixels that keep flipping between two colors, like a blinking
+ * cursor or a spinner, at one of them instead of sending every flip. Once the
+ * area has been quiet for a moment, it is sent as it really is. Call before
+ * pf_canvas.
+ */
+void pf_calm(bool on);
+
+/*
+ * pf_prefilled assumes pixelflut's canvas starts out in the background color
+ * passed to pf_send, so pixels of that color aren't sent until something
+ * else was sent in their place.
+ */
+void pf_prefilled(bool on);
+
+/*
+ * pf_damage marks a rect of the framebuffer as changed. Damage accumulates
+ * until pf_send gets to it, so pixels damaged again in the meantime are only
+ * sent once, in their latest color.
+ */
+void pf_damage(int x1, int x2, int y1, int y2);
+
+/*
+ * pf_send tells pixelflut about a slice of the damage, most urgent first, taking
+ * each pixel from RGB32 framebuffer fb as it is now and skipping those the
+ * shadow canvas already has. fb must hold the complete current frame, as wide
+ * as the canvas, because pixels lost to dropped connections are resent from
+ * it as well. Dropped connections are reconnected in the background. If
  * bgcolor isn't PF_NO_BGCOLOR, then occasionally repaint every pixel except
- * this color. Returns 0 on success.
+ * this color. PF_AUTO_BGCOLOR stands for the most common color of fb, once
+ * one stands out. Returns 0 on success.
+ */
+int pf_send(const uint32_t * const fb, uint32_t bgcolor);
+
+/*
+ * pf_pending returns true while pf_send has damage left to send over a pool
+ * that is at least partly up, not counting areas waiting for their rate cap
+ * or to be made exact.
+ * Poll for new frames in between pf_send calls to merge their damage into
+ * what's pending.
+ */
+bool pf_pending(void);
+
+/*
+ * pf_wake_ms returns how many ms until pf_pending will be true again without
+ * new damage, or pf_overloaded may turn false, or pf_send should read back
+ * pixels, or -1 if none of that will happen.
+ */
+int pf_wake_ms(void);
+
+/*
+ * pf_cursor tells where the pointer is, or x = -1 if it's hidden. Damage near
+ * it goes out first.
+ */
+void pf_cursor(int x, int y);
+
+/*
+ * pf_rate_cap limits areas of the screen that change more than hz times a
+ * second, say a playing video, to hz refreshes a second. The bandwidth they
+ * leave goes to the rest of the screen. 0 turns the cap off.
+ */
+void pf_rate_cap(double hz);
+
+/* the largest distance pf_threshold takes */
+#define PF_THRESHOLD_MAX 128
+
+/* longest spec pf_colors takes */
+#define PF_COLORS_LEN 128
+
+/*
+ * pf_colors transforms every color before it's compared with what pixelflut
+ * shows or sent, as described by spec, comma-separated settings of
+ * contrast=C (around the middle), gamma=G (2.2 for LED walls that show
+ * values linearly), brightness=B (at most 1, scaling the result) and
+ * levels=N (per channel, rounding the result to N steps). They're applied in
+ * that order, through a table per channel, while pixels are diffed and
+ * encoded. Instead of levels, palette=N shows the nearest of N colors picked
+ * from the first frame sent. dither=D, 0 to 1, adds an ordered dither of that
+ * strength before rounding to levels or the palette. Fewer levels or colors
+ * mean fewer pixels change. Returns 0 on success.
+ */
+int pf_colors(const char *spec);
+
+/*
+ * pf_threshold lets damaged pixels off if they're less than distance away from
+ * what pixelflut shows in every channel, so slow gradients and noisy video
+ * cost less. Approximate areas get their exact colors once they have been
+ * quiet for a moment. 0, the default, sends every change.
+ */
+void pf_threshold(int distance);
+
+/*
+ * pf_latency_target sets how many ms pending damage may take to send before
+ * pf_overloaded says to stop picking up new frames. 0, the default, never
+ * does.
+ */
+void pf_latency_target(int ms);
+
+/*
+ * pf_backlog_ms estimates how many ms it will take until the server has all
+ * pending damage, including what the sockets haven't delivered yet, at the
+ * rate it has been going lately, for the pool that is furthest behind. Safe
+ * to call from any thread.
+ */
+int pf_backlog_ms(void);
+
+/*
+ * pf_overloaded returns true once the backlog passes the latency target, and
+ * keeps returning true until the pending damage has been sent and the backlog
+ * is within the target again. Meanwhile, skip new frames, so what's pending
+ * isn't pushed back by newer damage; the next frame picked up brings the
+ * latest pixels of everything that changed.
+ */
+bool pf_overloaded(void);
+
+/*
+ * pf_verify reads back rate pixels a second from pixelflut over a couple of
+ * connections of their own, and compares them with what it should be showing.
+ * Areas another client painted over are repainted ahead of everything else,
+ * and sampled more closely from then on, so bandwidth goes to defending what
+ * is under attack instead of blindly resending everything. Call after
+ * pf_connect.
  */
-int pf_set_buf(const uint32_t * const fb, const int width, const int x1, const int x2, const int y1, const int y2, const uint32_t bgcolor);
+void pf_verify(int rate);
 
 /*
  * pf_close closes the connection pool opened by pf_connect and deallocates its
@@ -39,8 +286,8 @@ void pf_close(void);
 
 /*
  * pf_increase_sndbuf reconfigures open pixelflut sockets to increase their
- * send buffers SO_SNDBUF. The value is doubled `factor` times. Returns 0 on
- * success.
+ * send buffers SO_SNDBUF. The value is doubled `factor` times. Sockets opened
+ * later get the same treatment. Returns 0 on success.
  */
 int pf_increase_sndbuf(int factor);
 
@@ -50,4 +297,35 @@ int pf_increase_sndbuf(int factor);
  */
 int pf_asyncio(void);
 
+/*
+ * pf_zerocopy has TCP connections send output buffers of at least min bytes
+ * with MSG_ZEROCOPY, so the kernel pins them instead of copying them into the
+ * socket. Buffers are reused only once the kernel reports them released.
+ * Connections on which the kernel copies anyway go back to plain sends.
+ * Sockets opened later get the same treatment. Call after pf_connect.
+ */
+void pf_zerocopy(int min);
+
+/*
+ * pf_autoscale lets the connection pool grow and shrink between min and max
+ * connections while pixels are sent, following measured goodput. Unless
+ * pf_increase_sndbuf is used, send buffers are also sized to the
+ * bandwidth-delay product of each connection. Call after pf_connect. Returns
+ * 0 on success.
+ */
+int pf_autoscale(int min, int max);
+
+/*
+ * pf_num_conns returns the size of the connection pools of all threads
+ * together. Safe to call from any thread.
+ */
+int pf_num_conns(void);
+
+/*
+ * pf_conn_stats reports counters of connection i of the pools of all threads,
+ * numbered one pool after the other, or zeros if there's no such connection
+ * anymore. Safe to call from any thread.
+ */
+void pf_conn_stats(int i, struct pf_conn_stats *ret);
+
 /* vi: set ts=8 sts=8 sw=8 noet: */
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE		/* accept4 */
+
+#include <errno.h>	/* errno, EAGAIN */
+#include <netdb.h>	/* getaddrinfo */
+#include <netinet/in.h>	/* sockaddr_in, sockaddr_in6 */
+#include <poll.h>	/* poll */
+#include <stdbool.h>	/* bool, true, false */
+#include <stdio.h>	/* fprintf, perror */
+#include <stdlib.h>	/* calloc, free, malloc */
+#include <string.h>	/* memcpy, memmove, strrchr */
+#include <sys/socket.h>	/* accept4, bind, getsockname, listen, socket */
+#include <unistd.h>	/* close, read */
+
+#include "error.h"	/* ERR_* */
+#include "lz.h"		/* lz_decompress, LZ_BOUND */
+#include "pixelflut.h"	/* pf_*, struct pf_relay_block */
+
+#include "relay.h"
+
+#define RELAY_BACKLOG 4
+#define RELAY_TIMEOUT 100	/* ms between visits to the pool at most */
+
+/* the largest canvas taken, in pixels */
+#define RELAY_PIXELS_MAX (1 << 26)
+
+/* a whole block at most, header and all */
+#define RELAY_IN_LEN (sizeof(struct pf_relay_block) + LZ_BOUND(PF_RELAY_RAW_MAX))
+
+/* the canvas, as kernelflut sent it so far */
+static uint32_t *canvas;
+static uint32_t canvas_w, canvas_h;
+
+/* what's been read from the uplink, and a block unpacked */
+static uint8_t *in;
+static size_t in_len;
+static uint8_t *raw;
+
+int relay_listen(const char *addr)
+{
+	char host[256];
+	const char *port = addr;
+	const char *colon = strrchr(addr, ':');
+	if (colon) {
+		size_t len = colon - addr;
+		if (len >= sizeof(host))
+			return -1;
+		memcpy(host, addr, len);
+		host[len] = '\0';
+		port = colon + 1;
+	}
+
+	struct addrinfo *res;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	if (getaddrinfo(colon ? host : NULL, port, &hints, &res))
+		return -1;
+
+	int fd = -1;
+	for (struct addrinfo *p = res; p; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, p->ai_addr, p->ai_addrlen) && !listen(fd, RELAY_BACKLOG))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+int relay_port(int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *) &addr, &len))
+		return -1;
+	if (addr.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6 *) &addr)->sin6_port);
+	return ntohs(((struct sockaddr_in *) &addr)->sin_port);
+}
+
+/* get_varint reads a LEB128 varint from *p, before end, into v. Returns false if it's cut off. */
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint32_t *v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (*p == end)
+			return false;
+		uint8_t b = *(*p)++;
+		*v |= (uint32_t) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * apply unpacks block b into the canvas and damages what changed, in runs
+ * along rows. Returns 0 on success.
+ */
+static int apply(const struct pf_relay_block *b, const uint8_t *packed)
+{
+	if (canvas == NULL) {
+		int err = pf_canvas(b->width, b->height);
+		if (err)
+			return err;
+		canvas = calloc((size_t) b->width * b->height, sizeof(*canvas));
+		if (canvas == NULL) {
+			perror("couldn't allocate relay canvas");
+			return ERR_ALLOC;
+		}
+		canvas_w = b->width;
+		canvas_h = b->height;
+	}
+	if (b->width != canvas_w || b->height != canvas_h) {
+		fprintf(stderr, "uplink sent a %ux%u canvas, not %ux%u\n", b->width, b->height, canvas_w, canvas_h);
+		return ERR_PF_RECV;
+	}
+	pf_offset(b->offset_x, b->offset_y);
+
+	if (lz_decompress(packed, b->packed_len, raw, PF_RELAY_RAW_MAX) != (int) b->raw_len) {
+		fprintf(stderr, "uplink sent a block that doesn't unpack\n");
+		return ERR_PF_RECV;
+	}
+
+	const uint8_t *p = raw, *end = raw + b->raw_len;
+	uint32_t i = 0;
+	uint32_t run_y = 0, run_x1 = 0, run_x2 = 0;
+	while (p < end) {
+		uint32_t zigzag;
+		if (!get_varint(&p, end, &zigzag) || end - p < 3)
+			return ERR_PF_RECV;
+		i += (zigzag >> 1) ^ -(zigzag & 1);
+		if (i >= canvas_w * canvas_h)
+			return ERR_PF_RECV;
+		canvas[i] = p[0] << 16 | p[1] << 8 | p[2];
+		p += 3;
+
+		const uint32_t x = i % canvas_w, y = i / canvas_w;
+		if (run_x2 > run_x1 && y == run_y && x == run_x2) {
+			run_x2++;
+			continue;
+		}
+		if (run_x2 > run_x1)
+			pf_damage(run_x1, run_x2, run_y, run_y + 1);
+		run_y = y;
+		run_x1 = x;
+		run_x2 = x + 1;
+	}
+	if (run_x2 > run_x1)
+		pf_damage(run_x1, run_x2, run_y, run_y + 1);
+	return 0;
+}
+
+/*
+ * uplink_read reads what the uplink has and applies every whole block.
+ * Returns false if the uplink is gone or sent garbage.
+ */
+static bool uplink_read(int fd)
+{
+	for (;;) {
+		ssize_t n = read(fd, in + in_len, RELAY_IN_LEN - in_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (n <= 0)
+			return false;
+		in_len += n;
+
+		size_t used = 0;
+		struct pf_relay_block b;
+		while (in_len - used >= sizeof(b)) {
+			memcpy(&b, in + used, sizeof(b));
+			if (b.magic != PF_RELAY_MAGIC || !b.width || !b.height || (uint64_t) b.width * b.height > RELAY_PIXELS_MAX
+					|| b.raw_len > PF_RELAY_RAW_MAX || b.packed_len > LZ_BOUND(PF_RELAY_RAW_MAX)) {
+				fprintf(stderr, "uplink isn't kernelflut\n");
+				return false;
+			}
+			if (in_len - used < sizeof(b) + b.packed_len)
+				break;
+			if (apply(&b, in + used + sizeof(b)))
+				return false;
+			used += sizeof(b) + b.packed_len;
+		}
+		memmove(in, in + used, in_len - used);
+		in_len -= used;
+	}
+}
+
+int relay_serve(int listen_fd, volatile sig_atomic_t *stop)
+{
+	in = malloc(RELAY_IN_LEN);
+	raw = malloc(PF_RELAY_RAW_MAX);
+	if (in == NULL || raw == NULL) {
+		perror("couldn't allocate relay buffers");
+		free(in);
+		free(raw);
+		return ERR_ALLOC;
+	}
+
+	int uplink = -1;
+	int err = 0;
+	while (!*stop && !err) {
+		int timeout = pf_pending() ? 0 : pf_wake_ms();
+		if (timeout < 0 || timeout > RELAY_TIMEOUT)
+			timeout = RELAY_TIMEOUT;
+
+		struct pollfd fds[2] = {
+			{ .fd = listen_fd, .events = POLLIN },
+			{ .fd = uplink, .events = POLLIN },
+		};
+		poll(fds, 2, timeout);
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd >= 0) {
+				if (uplink >= 0)
+					close(uplink);
+				fprintf(stderr, "DEBUG: uplink connected\n");
+				uplink = fd;
+				in_len = 0;
+			}
+		}
+
+		if (uplink >= 0 && fds[1].revents && !uplink_read(uplink)) {
+			fprintf(stderr, "DEBUG: uplink closed\n");
+			close(uplink);
+			uplink = -1;
+			in_len = 0;
+		}
+
+		if (canvas)
+			err = pf_send(canvas, PF_NO_BGCOLOR);
+	}
+
+	if (uplink >= 0)
+		close(uplink);
+	free(canvas);
+	canvas = NULL;
+	free(in);
+	free(raw);
+	return err;
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <signal.h>	/* sig_atomic_t */
+
+/*
+ * relay_listen opens a socket for kernelflut to send blocks of pixels to, see
+ * struct pf_relay_block, at addr, [HOST:]PORT, on every address if HOST is
+ * left out. With a PORT of 0, a free one is picked; see relay_port. Returns
+ * the socket, or -1.
+ */
+int relay_listen(const char *addr);
+
+/* relay_port returns the port the socket fd of relay_listen is bound to. */
+int relay_port(int fd);
+
+/*
+ * relay_serve takes blocks of pixels from kernelflut on the socket listen_fd,
+ * one uplink at a time, and sends them on with the pixelflut state of the
+ * calling thread (see pixelflut.h), which must be connected already. It calls
+ * pf_canvas when the first block tells it the size. An uplink that connects
+ * replaces the one before, whose partial blocks are dropped; kernelflut
+ * resends their pixels. Returns once *stop is set, or with an error.
+ */
+int relay_serve(int listen_fd, volatile sig_atomic_t *stop);
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
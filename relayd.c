@@ -0,0 +1,138 @@
+/*
+ * kernelflut-relay runs on the pixelflut server's network. It takes the
+ * compressed blocks of changed pixels kernelflut sends to a relay:HOST target
+ * over one connection, which suits a WAN, and sends them on to the server as
+ * commands, with a connection pool and pacing of its own.
+ */
+
+#include <signal.h>	/* sigaction, sig_atomic_t */
+#include <stdbool.h>	/* bool, true, false */
+#include <stdio.h>	/* perror, fprintf */
+#include <stdlib.h>	/* atoi */
+#include <string.h>	/* memset */
+#include <unistd.h>	/* close, getopt */
+
+#include "error.h"	/* ERR_* */
+#include "metrics.h"	/* metrics_start, metrics_stop */
+#include "options.h"	/* options, options_* */
+#include "pixelflut.h"	/* pf_close */
+#include "relay.h"	/* relay_* */
+#include "stats.h"	/* stats_* */
+
+#define DEFAULT_LISTEN		"1338"
+#define DEFAULT_HOSTNAME	"localhost"
+#define DEFAULT_PORT		1337
+
+bool pt_active;
+volatile sig_atomic_t doomed;
+
+static void interrupt(int _, siginfo_t *__, void *___)
+{
+	(void) _;
+	(void) __;
+	(void) ___;
+
+	doomed = 1;
+}
+
+/* usage prints usage info to stderr. It returns ERR_BADARG for convenience. */
+static int usage(char *progname)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"  %s [options...] [HOST [PORT]]\n"
+		"\n"
+		"Arguments:\n"
+		"  HOST			pixelflut hostname or unix:PATH (default " DEFAULT_HOSTNAME ")\n"
+		"  PORT			pixelflut port (default %d)\n"
+		"\n"
+		"Options:\n"
+		"  -L ADDR		take kernelflut's relay:HOST uplink on [HOST:]PORT (default " DEFAULT_LISTEN ")\n"
+		"",
+		progname,
+		DEFAULT_PORT
+	);
+	options_usage(false);
+	return ERR_BADARG;
+}
+
+int main(int argc, char *argv[])
+{
+	/* handle SIGINT gracefully */
+	struct sigaction act;
+	memset(&act, 0, sizeof(act));
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_SIGINFO;
+	act.sa_sigaction = interrupt;
+	if (sigaction(SIGINT, &act, NULL) == -1) {
+		perror("DEBUG sigaction failed somehow");
+		return ERR_IRRECOVERABLE;
+	}
+
+	char *listen_addr = DEFAULT_LISTEN;
+
+	int opt;
+	while ((opt = getopt(argc, argv, OPTIONS_POOL "L:h?")) != -1) {
+		int err = options_parse(opt, optarg);
+		if (err > 0)
+			return usage(argv[0]);
+		if (!err)
+			continue;
+
+		switch (opt) {
+		case 'L':
+			listen_addr = optarg;
+			break;
+		case 'h':
+		case '?':
+			usage(argv[0]);
+			return 0;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	char *hostname = DEFAULT_HOSTNAME;
+	if (optind < argc)
+		hostname = argv[optind++];
+
+	int port = DEFAULT_PORT;
+	if (optind < argc) {
+		port = atoi(argv[optind++]);
+		if (port <= 0)
+			return usage(argv[0]);
+	}
+
+	if (optind < argc)
+		return usage(argv[0]);
+
+	stats_register();
+
+	int listen_fd = relay_listen(listen_addr);
+	if (listen_fd == -1) {
+		perror("couldn't listen for the uplink");
+		return ERR_PF_SOCKET;
+	}
+
+	int err = options_connect(hostname, port, options.connections);
+	if (err)
+		return err;
+
+	if (options.metrics_addr) {
+		err = metrics_start(options.metrics_addr);
+		if (err)
+			return err;
+	}
+
+	/* the canvas is set up once the uplink tells its size */
+	err = options_configure(options.rate_cap);
+	if (!err)
+		err = relay_serve(listen_fd, &doomed);
+
+	metrics_stop();
+	pf_close();
+	close(listen_fd);
+	return err;
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
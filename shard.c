@@ -0,0 +1,611 @@
+#include <pthread.h>	/* pthread_* */
+#include <stdbool.h>	/* bool, true, false */
+#include <stdio.h>	/* fgets, fopen, fprintf, perror, snprintf, sscanf */
+#include <stdlib.h>	/* atoi, calloc, free, strtod */
+#include <string.h>	/* memcmp, memcpy, memmove, strchr, strcmp, strdup, strlen, strncmp, strrchr, strspn, strtok_r */
+#include <time.h>	/* clock_gettime */
+
+#include "error.h"	/* ERR_* */
+#include "pixelflut.h"	/* pf_* */
+#include "stats.h"	/* stats_* */
+#include "trace.h"	/* trace_frame_* */
+
+#include "shard.h"
+
+#define SHARD_LINE 512
+#define SHARD_RECTS 16		/* damage rects a shard holds before merging them */
+
+/*
+ * struct shard_canvas is a region of the monitor, scaled, as the shards
+ * showing it read it. Mirrors share one, so each frame is copied and scaled
+ * once, by the thread calling shard_damage, however many servers show it.
+ */
+struct shard_canvas {
+	struct evdi_rect region;
+	int width, height;
+	uint32_t *pixels;
+	int refs;		/* shards reading it */
+	uint64_t copied;	/* damage_seq of the last frame copied in */
+	uint64_t copy_ns;	/* spent on it */
+};
+
+struct shard {
+	struct shard_config config;
+	pthread_t thread;
+	bool started;
+	struct shard_canvas *canvas;
+
+	/* damage of the canvas the thread hasn't picked up yet */
+	pthread_cond_t wake;
+	struct evdi_rect rects[SHARD_RECTS];
+	int num_rects;
+	uint64_t ready;		/* of the oldest damage */
+	uint64_t copy_ns;	/* spent copying it */
+	int cursor_x, cursor_y;	/* on the canvas, or -1 */
+	bool stop;
+
+	/* published by the thread */
+	bool set_up;
+	bool pending;
+	bool overloaded;
+	int err;
+};
+
+/* everything below, and every struct shard, is under lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed;	/* a shard set up, finished sending or failed */
+static struct shard *shards;
+static int num_shards;
+
+/* only touched by the thread calling shard_damage */
+static uint64_t damage_seq;
+
+/* set by shard_start */
+static int (*shard_setup)(const struct shard_config *s);
+static int monitor_w;
+static uint32_t background;
+
+/* wait_ms waits on cond for at most ms, or for good if ms is negative */
+static void wait_ms(pthread_cond_t *cond, int ms)
+{
+	if (ms < 0) {
+		pthread_cond_wait(cond, &lock);
+		return;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += ms % 1000 * 1000 * 1000;
+	if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000 * 1000 * 1000;
+	}
+	pthread_cond_timedwait(cond, &lock, &ts);
+}
+
+/* idle returns true while s has nothing left to send */
+static bool idle(const struct shard *s)
+{
+	return !s->err && !s->num_rects && !s->pending;
+}
+
+/* busy returns true while s has damage to send, or is overloaded */
+static bool busy(const struct shard *s)
+{
+	return !s->err && (s->num_rects || s->pending || s->overloaded);
+}
+
+/*
+ * canvas_get returns the canvas showing the region of cfg at its size, shared
+ * with the shards before it if they show the same, or NULL
+ */
+static struct shard_canvas *canvas_get(const struct shard_config *cfg)
+{
+	for (int i = 0; i < num_shards; i++) {
+		struct shard_canvas *c = shards[i].canvas;
+		if (c && !memcmp(&c->region, &cfg->region, sizeof(c->region)) && c->width == cfg->width && c->height == cfg->height) {
+			c->refs++;
+			return c;
+		}
+	}
+
+	struct shard_canvas *c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->pixels = calloc((size_t) cfg->width * cfg->height, sizeof(*c->pixels));
+	if (c->pixels == NULL) {
+		free(c);
+		return NULL;
+	}
+	c->region = cfg->region;
+	c->width = cfg->width;
+	c->height = cfg->height;
+	c->refs = 1;
+	return c;
+}
+
+/* canvas_put lets go of c, freeing it once no shard reads it */
+static void canvas_put(struct shard_canvas *c)
+{
+	if (c == NULL || --c->refs)
+		return;
+	free(c->pixels);
+	free(c);
+}
+
+/* canvas_rect returns the damage of c caused by damage r of its region */
+static struct evdi_rect canvas_rect(const struct shard_canvas *c, struct evdi_rect r)
+{
+	const int rw = c->region.x2 - c->region.x1, rh = c->region.y2 - c->region.y1;
+	const int w = c->width, h = c->height;
+
+	struct evdi_rect d = {
+		.x1 = (r.x1 - c->region.x1) * w / rw,
+		.y1 = (r.y1 - c->region.y1) * h / rh,
+		.x2 = ((r.x2 - c->region.x1) * w + rw - 1) / rw,
+		.y2 = ((r.y2 - c->region.y1) * h + rh - 1) / rh,
+	};
+	return d;
+}
+
+/*
+ * canvas_copy scales damage d of c from the monitor framebuffer fb into c,
+ * nearest neighbor
+ */
+static void canvas_copy(struct shard_canvas *c, const uint32_t *fb, struct evdi_rect d)
+{
+	const int rw = c->region.x2 - c->region.x1, rh = c->region.y2 - c->region.y1;
+	const int w = c->width, h = c->height;
+
+	for (int y = d.y1; y < d.y2; y++) {
+		const uint32_t *src = fb + (c->region.y1 + y * rh / h) * monitor_w + c->region.x1;
+		uint32_t *dst = c->pixels + y * w;
+		if (w == rw) {
+			memcpy(dst + d.x1, src + d.x1, (d.x2 - d.x1) * sizeof(*dst));
+			continue;
+		}
+		for (int x = d.x1; x < d.x2; x++)
+			dst[x] = src[x * rw / w];
+	}
+}
+
+/* clip returns r clipped to g, which is empty if they don't overlap */
+static struct evdi_rect clip(struct evdi_rect r, const struct evdi_rect *g)
+{
+	struct evdi_rect c = {
+		.x1 = r.x1 > g->x1 ? r.x1 : g->x1,
+		.y1 = r.y1 > g->y1 ? r.y1 : g->y1,
+		.x2 = r.x2 < g->x2 ? r.x2 : g->x2,
+		.y2 = r.y2 < g->y2 ? r.y2 : g->y2,
+	};
+	return c;
+}
+
+/*
+ * shard_run keeps a shard's server up to date, the way kernelflut's loop does
+ * for a single server, but picks damage up from shard_damage instead of EVDI
+ */
+static void *shard_run(void *arg)
+{
+	struct shard *s = arg;
+	struct evdi_rect rects[SHARD_RECTS];
+	bool frame_open = false;
+
+	stats_register();
+	int err = shard_setup(&s->config);
+
+	pthread_mutex_lock(&lock);
+	s->set_up = true;
+	s->err = err;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+
+	while (!err) {
+		pthread_mutex_lock(&lock);
+
+		/* while overloaded, damage piles up in the mailbox, as in EVDI */
+		const bool take = !pf_overloaded();
+		if (!s->stop && !pf_pending() && !(take && s->num_rects))
+			wait_ms(&s->wake, pf_wake_ms());
+		if (s->stop) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+
+		const uint64_t ready = s->ready;
+		uint64_t copy_ns = 0;
+		int n = 0;
+		if (take) {
+			n = s->num_rects;
+			memcpy(rects, s->rects, n * sizeof(*rects));
+			s->num_rects = 0;
+			copy_ns = s->copy_ns;
+			s->copy_ns = 0;
+		}
+		pf_cursor(s->cursor_x, s->cursor_y);
+		pthread_mutex_unlock(&lock);
+
+		if (n) {
+			/* the copy was made by shard_damage, but it's this frame's */
+			uint64_t damaged = 0;
+			for (int k = 0; k < n; k++) {
+				damaged += (rects[k].x2 - rects[k].x1) * (rects[k].y2 - rects[k].y1);
+				pf_damage(rects[k].x1, rects[k].x2, rects[k].y1, rects[k].y2);
+			}
+			stats_stage_add(STAGE_CAPTURE, copy_ns, damaged);
+			trace_frame_begin(ready);
+			frame_open = true;
+		}
+
+		err = pf_send(s->canvas->pixels, background);
+
+		const bool pending = pf_pending(), overloaded = pf_overloaded();
+		if (frame_open && !pending) {
+			trace_frame_end();
+			stats_frame_end();
+			frame_open = false;
+		}
+
+		pthread_mutex_lock(&lock);
+		if (err || pending != s->pending || overloaded != s->overloaded) {
+			s->err = err;
+			s->pending = pending;
+			s->overloaded = overloaded;
+			pthread_cond_broadcast(&changed);
+		}
+		pthread_mutex_unlock(&lock);
+	}
+
+	pf_close();
+	stats_unregister();
+	return NULL;
+}
+
+/* parse_setting applies one key=value setting of a shard line to cfg. Returns false if it's bad. */
+static bool parse_setting(struct shard_config *cfg, char *setting)
+{
+	char *value = strchr(setting, '=');
+	if (value == NULL)
+		return false;
+	*value++ = '\0';
+
+	if (!strcmp(setting, "port")) {
+		cfg->port = atoi(value);
+		return cfg->port > 0;
+	}
+	if (!strcmp(setting, "connections")) {
+		cfg->connections = atoi(value);
+		return cfg->connections > 0;
+	}
+	if (!strcmp(setting, "size"))
+		return sscanf(value, "%dx%d", &cfg->width, &cfg->height) == 2 && cfg->width > 0 && cfg->height > 0;
+	if (!strcmp(setting, "offset"))
+		return sscanf(value, "%d,%d", &cfg->offset_x, &cfg->offset_y) == 2 && cfg->offset_x >= 0 && cfg->offset_y >= 0;
+	if (!strcmp(setting, "rate")) {
+		cfg->rate_cap = strtod(value, NULL);
+		return cfg->rate_cap >= 0;
+	}
+	return false;
+}
+
+/* shard_new returns the config of a new shard, or NULL if there's no room */
+static struct shard_config *shard_new(void)
+{
+	if (shards == NULL)
+		shards = calloc(SHARD_MAX, sizeof(*shards));
+	if (shards == NULL || num_shards == SHARD_MAX)
+		return NULL;
+	return &shards[num_shards].config;
+}
+
+int shard_add(const struct shard_config *s)
+{
+	struct shard_config *cfg = shard_new();
+	if (cfg == NULL) {
+		fprintf(stderr, "more than %d servers\n", SHARD_MAX);
+		return ERR_BADARG;
+	}
+
+	*cfg = *s;
+	cfg->host = strdup(s->host);
+	num_shards++;
+	return 0;
+}
+
+int shard_mirror(const char *target, const struct shard_config *defaults)
+{
+	struct shard_config cfg = *defaults;
+	char host[SHARD_LINE];
+	snprintf(host, sizeof(host), "%s", target);
+	cfg.host = host;
+
+	/* unix:PATH and shm:PATH take no port */
+	if (!strncmp(host, "unix:", 5) || !strncmp(host, "shm:", 4))
+		return shard_add(&cfg);
+
+	/*
+	 * relay:HOST takes one like any HOST. An IPv6 address with a port
+	 * goes in brackets; without, its last colon isn't taken for one.
+	 */
+	char *name = strncmp(host, "relay:", 6) ? host : host + 6;
+	char *addr = name, *port = NULL;
+	if (*name == '[') {
+		char *end = strchr(name, ']');
+		if (end == NULL || (end[1] && end[1] != ':'))
+			goto bad;
+		*end = '\0';
+		addr = name + 1;
+		if (end[1])
+			port = end + 2;
+	} else {
+		char *colon = strrchr(name, ':');
+		if (colon && strchr(name, ':') == colon) {
+			*colon = '\0';
+			port = colon + 1;
+		}
+	}
+
+	if (!*addr)
+		goto bad;
+	if (port) {
+		if (!*port || strspn(port, "0123456789") != strlen(port))
+			goto bad;
+		cfg.port = atoi(port);
+		if (cfg.port <= 0)
+			goto bad;
+	}
+	memmove(name, addr, strlen(addr) + 1);
+	return shard_add(&cfg);
+
+bad:
+	fprintf(stderr, "mirror %s should be [relay:]HOST[:PORT], with an IPv6 HOST in brackets\n", target);
+	return ERR_BADARG;
+}
+
+int shard_load(const char *path, const struct shard_config *defaults)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("couldn't open shards");
+		return ERR_BADARG;
+	}
+
+	char line[SHARD_LINE];
+	const char *problem = NULL;
+	int lineno = 0;
+	while (problem == NULL && fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		char *save;
+		char *region = strtok_r(line, " \t\n", &save);
+		if (region == NULL || *region == '#')
+			continue;
+		struct shard_config *cfg = shard_new();
+		if (cfg == NULL) {
+			problem = "too many shards";
+			break;
+		}
+		*cfg = *defaults;
+		int w, h, x, y;
+		if (sscanf(region, "%dx%d+%d+%d", &w, &h, &x, &y) != 4 || w <= 0 || h <= 0 || x < 0 || y < 0) {
+			problem = "region should be WxH+X+Y";
+			break;
+		}
+		cfg->region = (struct evdi_rect) { x, y, x + w, y + h };
+		cfg->width = w;
+		cfg->height = h;
+
+		char *host = strtok_r(NULL, " \t\n", &save);
+		if (host == NULL) {
+			problem = "no host";
+			break;
+		}
+
+		for (char *setting; problem == NULL && (setting = strtok_r(NULL, " \t\n", &save));)
+			if (!parse_setting(cfg, setting))
+				problem = "settings are port=PORT, connections=N, size=WxH, offset=X,Y and rate=HZ";
+
+		cfg->host = strdup(host);
+		num_shards++;
+	}
+	fclose(f);
+
+	if (problem == NULL && !num_shards) {
+		problem = "no shards";
+		lineno = 0;
+	}
+	if (problem) {
+		fprintf(stderr, "%s:%d: %s\n", path, lineno, problem);
+		shard_stop();
+		return ERR_BADARG;
+	}
+	return 0;
+}
+
+int shard_start(int (*setup)(const struct shard_config *s), int width, int height, uint32_t bgcolor)
+{
+	shard_setup = setup;
+	monitor_w = width;
+	background = bgcolor;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&changed, &attr);
+
+	for (int i = 0; i < num_shards; i++) {
+		struct shard *s = &shards[i];
+		const struct shard_config *cfg = &s->config;
+		if (cfg->region.x2 > width || cfg->region.y2 > height) {
+			fprintf(stderr, "shard %d on %s is off the %dx%d monitor\n", i, cfg->host, width, height);
+			return ERR_BADARG;
+		}
+
+		s->canvas = canvas_get(cfg);
+		if (s->canvas == NULL) {
+			perror("couldn't allocate shard canvas");
+			return ERR_ALLOC;
+		}
+
+		pthread_cond_init(&s->wake, &attr);
+		s->cursor_x = -1;
+		s->cursor_y = -1;
+		if (pthread_create(&s->thread, NULL, shard_run, s)) {
+			perror("shard pthread_create");
+			return ERR_IRRECOVERABLE;
+		}
+		s->started = true;
+	}
+
+	/* every shard connects on its own, all at once */
+	pthread_mutex_lock(&lock);
+	int err = 0;
+	for (;;) {
+		int set_up = 0;
+		for (int i = 0; i < num_shards; i++) {
+			set_up += shards[i].set_up;
+			if (shards[i].err)
+				err = shards[i].err;
+		}
+		if (err || set_up == num_shards)
+			break;
+		pthread_cond_wait(&changed, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return err;
+}
+
+void shard_damage(const uint32_t *fb, const struct evdi_rect *rects, int num_rects, uint64_t ready, int cursor_x, int cursor_y)
+{
+	/*
+	 * copy every canvas once, outside the lock; the shards only read
+	 * them, and catch up on anything they read half-way with this damage
+	 */
+	damage_seq++;
+	for (int i = 0; i < num_shards; i++) {
+		struct shard_canvas *c = shards[i].canvas;
+		if (c->copied == damage_seq)
+			continue;
+		c->copied = damage_seq;
+
+		uint64_t t = stats_now();
+		for (int k = 0; k < num_rects; k++) {
+			struct evdi_rect r = clip(rects[k], &c->region);
+			if (r.x1 < r.x2 && r.y1 < r.y2)
+				canvas_copy(c, fb, canvas_rect(c, r));
+		}
+		c->copy_ns = stats_now() - t;
+	}
+
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < num_shards; i++) {
+		struct shard *s = &shards[i];
+		const struct evdi_rect *g = &s->config.region;
+		const int rw = g->x2 - g->x1, rh = g->y2 - g->y1;
+
+		bool damaged = false;
+		for (int k = 0; k < num_rects; k++) {
+			struct evdi_rect r = clip(rects[k], g);
+			if (r.x1 >= r.x2 || r.y1 >= r.y2)
+				continue;
+			struct evdi_rect c = canvas_rect(s->canvas, r);
+			damaged = true;
+
+			if (!s->num_rects)
+				s->ready = ready;
+			if (s->num_rects < SHARD_RECTS) {
+				s->rects[s->num_rects++] = c;
+				continue;
+			}
+
+			/* out of room, so the last one grows to cover it */
+			struct evdi_rect *last = &s->rects[SHARD_RECTS - 1];
+			last->x1 = c.x1 < last->x1 ? c.x1 : last->x1;
+			last->y1 = c.y1 < last->y1 ? c.y1 : last->y1;
+			last->x2 = c.x2 > last->x2 ? c.x2 : last->x2;
+			last->y2 = c.y2 > last->y2 ? c.y2 : last->y2;
+		}
+
+		if (damaged)
+			s->copy_ns += s->canvas->copy_ns;
+		s->cursor_x = -1;
+		s->cursor_y = -1;
+		if (cursor_x >= g->x1 && cursor_x < g->x2 && cursor_y >= g->y1 && cursor_y < g->y2) {
+			s->cursor_x = (cursor_x - g->x1) * s->config.width / rw;
+			s->cursor_y = (cursor_y - g->y1) * s->config.height / rh;
+		}
+		if (damaged)
+			pthread_cond_signal(&s->wake);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+bool shard_pending(void)
+{
+	bool pending = true;
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < num_shards; i++)
+		pending &= !idle(&shards[i]);
+	pthread_mutex_unlock(&lock);
+	return pending;
+}
+
+bool shard_overloaded(void)
+{
+	bool overloaded = true;
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < num_shards; i++)
+		overloaded &= shards[i].overloaded;
+	pthread_mutex_unlock(&lock);
+	return overloaded;
+}
+
+void shard_wait(int timeout_ms)
+{
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < num_shards; i++) {
+		if (busy(&shards[i])) {
+			wait_ms(&changed, timeout_ms);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int shard_error(void)
+{
+	int err = 0;
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < num_shards && !err; i++)
+		err = shards[i].err;
+	pthread_mutex_unlock(&lock);
+	return err;
+}
+
+void shard_stop(void)
+{
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < num_shards; i++) {
+		shards[i].stop = true;
+		if (shards[i].started)
+			pthread_cond_signal(&shards[i].wake);
+	}
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < num_shards; i++) {
+		struct shard *s = &shards[i];
+		if (s->started) {
+			pthread_join(s->thread, NULL);
+			pthread_cond_destroy(&s->wake);
+		}
+		canvas_put(s->canvas);
+		free(s->config.host);
+	}
+
+	free(shards);
+	shards = NULL;
+	num_shards = 0;
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
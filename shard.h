@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdbool.h>	/* bool */
+#include <stdint.h>	/* uint32_t, uint64_t */
+
+#include "evdi.h"	/* evdi_rect */
+
+/* shards of a wall at most */
+#define SHARD_MAX 32
+
+/*
+ * struct shard_config is one pixelflut server of a wall, showing a region of
+ * the monitor.
+ */
+struct shard_config {
+	char *host;
+	int port;
+	int connections;
+	struct evdi_rect region;	/* of the monitor */
+	int width, height;		/* of the region on the server, scaled */
+	int offset_x, offset_y;		/* of the region on the server's canvas */
+	double rate_cap;		/* Hz, see pf_rate_cap, or 0 */
+};
+
+/*
+ * shard_load reads the shards of a wall from the file at path, one per line:
+ *
+ *	WxH+X+Y HOST [port=PORT] [connections=N] [size=WxH] [offset=X,Y] [rate=HZ]
+ *
+ * WxH+X+Y is the region of the monitor the shard shows, scaled to size on the
+ * server and placed at offset on its canvas. Settings left out are taken from
+ * defaults, except that size defaults to the size of the region. Empty lines
+ * and lines starting with # are skipped. Returns 0 on success.
+ */
+int shard_load(const char *path, const struct shard_config *defaults);
+
+/*
+ * shard_add adds a shard as configured by s. Returns 0 on success.
+ */
+int shard_add(const struct shard_config *s);
+
+/*
+ * shard_mirror adds a shard like defaults, but on the server at target,
+ * HOST[:PORT], on the port of defaults unless given. HOST may be relay:HOST,
+ * and is an IPv6 address in brackets to be given a port; unix:PATH and
+ * shm:PATH take none. Returns 0 on success.
+ */
+int shard_mirror(const char *target, const struct shard_config *defaults);
+
+/*
+ * shard_start starts a thread for every shard loaded, which calls setup to
+ * connect and configure its own pixelflut state (see pixelflut.h), and then
+ * keeps its region of the monitor on its server, following the damage passed
+ * to shard_damage. The monitor is width x height. Returns 0 once every shard
+ * is set up. If not, shard_stop must still be called.
+ */
+int shard_start(int (*setup)(const struct shard_config *s), int width, int height, uint32_t bgcolor);
+
+/*
+ * shard_damage copies the damage of a frame just grabbed into the RGB32
+ * framebuffer fb into the shards' canvases, once for shards showing the same
+ * region at the same size, and passes it on to the shards it touches. Shards
+ * that are still busy merge it with what they haven't picked up yet, so a
+ * slow server never holds up a fast one. They may be reading their canvas
+ * meanwhile; what they catch half-way is damaged again by this frame.
+ */
+void shard_damage(const uint32_t *fb, const struct evdi_rect *rects, int num_rects, uint64_t ready, int cursor_x, int cursor_y);
+
+/* shard_pending returns true while no shard is done sending. */
+bool shard_pending(void);
+
+/*
+ * shard_overloaded returns true while every shard is, see pf_overloaded. An
+ * overloaded shard lets its damage pile up until it has caught up.
+ */
+bool shard_overloaded(void);
+
+/*
+ * shard_wait waits until a shard is done sending or no longer overloaded, or
+ * timeout_ms have passed.
+ */
+void shard_wait(int timeout_ms);
+
+/* shard_error returns the error a shard stopped with, or 0. */
+int shard_error(void);
+
+/*
+ * shard_stop stops the threads of the shards, which close their pools, and
+ * forgets the shards. Redundant calls are safe.
+ */
+void shard_stop(void);
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
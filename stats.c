@@ -0,0 +1,250 @@
+#include <pthread.h>	/* pthread_mutex_* */
+#include <stdio.h>	/* fprintf */
+#include <string.h>	/* memset */
+
+#include "stats.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+__thread struct stats stats;
+
+/* registered threads, and the totals of threads that have exited */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats *registry;
+static struct stats retired;
+
+const char * const stats_stage_names[STAGES] = {
+	[STAGE_CAPTURE] = "capture",
+	[STAGE_DIFF] = "diff",
+	[STAGE_ENCODE] = "encode",
+	[STAGE_SEND] = "send",
+};
+
+const char * const stats_latency_names[LATENCIES] = {
+	[LATENCY_GRAB] = "grab",
+	[LATENCY_ENCODE] = "encode",
+	[LATENCY_SEND] = "send",
+	[LATENCY_RECT] = "rect",
+	[LATENCY_FRAME] = "frame",
+};
+
+static int hist_index(uint64_t value)
+{
+	if (value < HIST_SUB)
+		return value;
+
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - HIST_SUB_BITS;
+	int sub = (value >> shift) & (HIST_SUB - 1);
+	return (shift + 1) * HIST_SUB + sub;
+}
+
+/* hist_upper returns the largest value that falls into bucket i */
+static uint64_t hist_upper(int i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	int shift = i / HIST_SUB - 1;
+	int sub = i % HIST_SUB;
+	return (((uint64_t) (HIST_SUB + sub)) << shift) + (((uint64_t) 1) << shift) - 1;
+}
+
+void hist_add(struct hist *h, uint64_t value)
+{
+	int i = hist_index(value);
+	STORE(h->buckets[i], h->buckets[i] + 1);
+	STORE(h->sum, h->sum + value);
+	if (value > h->max)
+		STORE(h->max, value);
+	STORE(h->count, h->count + 1);
+}
+
+/* hist_merge adds src, which may belong to another thread, into dst */
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += LOAD(src->buckets[i]);
+	dst->count += LOAD(src->count);
+	dst->sum += LOAD(src->sum);
+	uint64_t max = LOAD(src->max);
+	if (max > dst->max)
+		dst->max = max;
+}
+
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+	if (!h->count)
+		return 0;
+
+	uint64_t rank = (uint64_t) (h->count * p / 100.0 + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			uint64_t upper = hist_upper(i);
+			return upper < h->max ? upper : h->max;
+		}
+	}
+	return h->max;
+}
+
+uint64_t hist_count_le(const struct hist *h, uint64_t value)
+{
+	uint64_t n = 0;
+	for (int i = 0; i < HIST_BUCKETS && hist_upper(i) <= value; i++)
+		n += h->buckets[i];
+	return n;
+}
+
+/* stats_merge adds src, which may belong to another thread, into dst */
+static void stats_merge(struct stats *dst, const struct stats *src)
+{
+	dst->frames += LOAD(src->frames);
+	dst->frames_dropped += LOAD(src->frames_dropped);
+	dst->rects += LOAD(src->rects);
+	dst->pixels_considered += LOAD(src->pixels_considered);
+	dst->pixels_skipped += LOAD(src->pixels_skipped);
+	dst->pixels_sent += LOAD(src->pixels_sent);
+	dst->bytes += LOAD(src->bytes);
+	dst->syscalls += LOAD(src->syscalls);
+	dst->eagain += LOAD(src->eagain);
+	dst->conn_failures += LOAD(src->conn_failures);
+	dst->reconnects += LOAD(src->reconnects);
+	dst->pixels_replayed += LOAD(src->pixels_replayed);
+	dst->tiles_moved += LOAD(src->tiles_moved);
+	dst->pixels_calmed += LOAD(src->pixels_calmed);
+	dst->bytes_calmed += LOAD(src->bytes_calmed);
+	dst->pixels_verified += LOAD(src->pixels_verified);
+	dst->pixels_overwritten += LOAD(src->pixels_overwritten);
+	dst->zerocopy_sends += LOAD(src->zerocopy_sends);
+	dst->zerocopy_copied += LOAD(src->zerocopy_copied);
+
+	for (int s = 0; s < STAGES; s++) {
+		hist_merge(&dst->stage[s].latency, &src->stage[s].latency);
+		hist_merge(&dst->stage[s].rate, &src->stage[s].rate);
+	}
+	for (int l = 0; l < LATENCIES; l++)
+		hist_merge(&dst->latency[l], &src->latency[l]);
+}
+
+void stats_register(void)
+{
+	if (stats.registered)
+		return;
+
+	pthread_mutex_lock(&registry_lock);
+	stats.next = registry;
+	registry = &stats;
+	stats.registered = true;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+void stats_unregister(void)
+{
+	if (!stats.registered)
+		return;
+
+	pthread_mutex_lock(&registry_lock);
+	for (struct stats **p = &registry; *p; p = &(*p)->next) {
+		if (*p == &stats) {
+			*p = stats.next;
+			break;
+		}
+	}
+	stats_merge(&retired, &stats);
+	stats.registered = false;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+void stats_sum(struct stats *out)
+{
+	memset(out, 0, sizeof(*out));
+
+	pthread_mutex_lock(&registry_lock);
+	stats_merge(out, &retired);
+	for (struct stats *p = registry; p; p = p->next)
+		stats_merge(out, p);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+void stats_frame_end(void)
+{
+	STATS_ADD(frames, 1);
+	for (int s = 0; s < STAGES; s++) {
+		uint64_t ns = stats.frame_ns[s];
+		hist_add(&stats.stage[s].latency, ns);
+		if (ns && stats.frame_pixels[s])
+			hist_add(&stats.stage[s].rate, stats.frame_pixels[s] * 1000 * 1000 * 1000 / ns);
+	}
+
+	memset(stats.frame_ns, 0, sizeof(stats.frame_ns));
+	memset(stats.frame_pixels, 0, sizeof(stats.frame_pixels));
+}
+
+static void hist_json(FILE *f, const char *name, const struct hist *h)
+{
+	fprintf(f, "\"%s\": {\"count\": %llu, \"p50\": %llu, \"p99\": %llu, \"max\": %llu}",
+			name,
+			(unsigned long long) h->count,
+			(unsigned long long) hist_percentile(h, 50),
+			(unsigned long long) hist_percentile(h, 99),
+			(unsigned long long) h->max);
+}
+
+void stats_json(FILE *f, uint64_t elapsed_ns)
+{
+	static struct stats total;
+	stats_sum(&total);
+
+	double secs = elapsed_ns / 1e9;
+	double frames = total.frames ? total.frames : 1;
+	double sent = total.pixels_sent ? total.pixels_sent : 1;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"elapsed_sec\": %.6f,\n", secs);
+	fprintf(f, "  \"frames\": %llu,\n", (unsigned long long) total.frames);
+	fprintf(f, "  \"frames_dropped\": %llu,\n", (unsigned long long) total.frames_dropped);
+	fprintf(f, "  \"rects\": %llu,\n", (unsigned long long) total.rects);
+	fprintf(f, "  \"pixels_considered\": %llu,\n", (unsigned long long) total.pixels_considered);
+	fprintf(f, "  \"pixels_sent\": %llu,\n", (unsigned long long) total.pixels_sent);
+	fprintf(f, "  \"bytes_sent\": %llu,\n", (unsigned long long) total.bytes);
+	fprintf(f, "  \"syscalls\": %llu,\n", (unsigned long long) total.syscalls);
+	fprintf(f, "  \"eagain\": %llu,\n", (unsigned long long) total.eagain);
+	fprintf(f, "  \"conn_failures\": %llu,\n", (unsigned long long) total.conn_failures);
+	fprintf(f, "  \"reconnects\": %llu,\n", (unsigned long long) total.reconnects);
+	fprintf(f, "  \"pixels_replayed\": %llu,\n", (unsigned long long) total.pixels_replayed);
+	fprintf(f, "  \"tiles_moved\": %llu,\n", (unsigned long long) total.tiles_moved);
+	fprintf(f, "  \"pixels_calmed\": %llu,\n", (unsigned long long) total.pixels_calmed);
+	fprintf(f, "  \"bytes_calmed\": %llu,\n", (unsigned long long) total.bytes_calmed);
+	fprintf(f, "  \"pixels_verified\": %llu,\n", (unsigned long long) total.pixels_verified);
+	fprintf(f, "  \"pixels_overwritten\": %llu,\n", (unsigned long long) total.pixels_overwritten);
+	fprintf(f, "  \"zerocopy_sends\": %llu,\n", (unsigned long long) total.zerocopy_sends);
+	fprintf(f, "  \"zerocopy_copied\": %llu,\n", (unsigned long long) total.zerocopy_copied);
+	fprintf(f, "  \"pixels_per_sec\": %.1f,\n", secs > 0 ? total.pixels_sent / secs : 0);
+	fprintf(f, "  \"bytes_per_pixel\": %.3f,\n", total.bytes / sent);
+	fprintf(f, "  \"syscalls_per_frame\": %.3f,\n", total.syscalls / frames);
+	fprintf(f, "  \"stages\": {\n");
+	for (int s = 0; s < STAGES; s++) {
+		fprintf(f, "    \"%s\": {", stats_stage_names[s]);
+		hist_json(f, "latency_ns", &total.stage[s].latency);
+		fprintf(f, ", ");
+		hist_json(f, "pixels_per_sec", &total.stage[s].rate);
+		fprintf(f, "}%s\n", s + 1 < STAGES ? "," : "");
+	}
+	fprintf(f, "  },\n");
+	fprintf(f, "  \"latency_ns\": {\n");
+	for (int l = 0; l < LATENCIES; l++) {
+		fprintf(f, "    ");
+		hist_json(f, stats_latency_names[l], &total.latency[l]);
+		fprintf(f, "%s\n", l + 1 < LATENCIES ? "," : "");
+	}
+	fprintf(f, "  }\n");
+	fprintf(f, "}\n");
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stdbool.h>	/* bool */
+#include <stdint.h>	/* uint64_t */
+#include <stdio.h>	/* FILE */
+#include <time.h>	/* clock_gettime */
+
+/* histogram resolution: each power of two is split into this many buckets */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(64 * HIST_SUB)
+
+/* pipeline stages, timed separately */
+enum stats_stage {
+	STAGE_CAPTURE,
+	STAGE_DIFF,
+	STAGE_ENCODE,
+	STAGE_SEND,
+	STAGES
+};
+
+/* end-to-end latencies, from the moment EVDI reports an update as ready */
+enum stats_latency {
+	LATENCY_GRAB,		/* update ready until pixels grabbed */
+	LATENCY_ENCODE,		/* pixels grabbed until the last rect is encoded */
+	LATENCY_SEND,		/* last rect encoded until its last byte is sent */
+	LATENCY_RECT,		/* update ready until a rect's last byte is sent */
+	LATENCY_FRAME,		/* update ready until the frame's last byte is sent */
+	LATENCIES
+};
+
+extern const char * const stats_stage_names[STAGES];
+extern const char * const stats_latency_names[LATENCIES];
+
+/*
+ * struct hist is a log-linear histogram of unsigned values. Relative error of
+ * reported percentiles is bounded by 1 / HIST_SUB.
+ */
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+struct stats_stage_hists {
+	struct hist latency;	/* ns per frame spent in this stage */
+	struct hist rate;	/* pixels per second through this stage */
+};
+
+/*
+ * struct stats holds the counters of one thread. Only the owning thread writes
+ * to it, always through STATS_ADD or hist_add, so other threads may read it at
+ * any time without locks.
+ */
+struct stats {
+	uint64_t frames;
+	uint64_t frames_dropped;
+	uint64_t rects;
+	uint64_t pixels_considered;
+	uint64_t pixels_skipped;
+	uint64_t pixels_sent;
+	uint64_t bytes;
+	uint64_t syscalls;
+	uint64_t eagain;
+	uint64_t conn_failures;
+	uint64_t reconnects;
+	uint64_t pixels_replayed;
+	uint64_t tiles_moved;
+	uint64_t pixels_calmed;
+	uint64_t bytes_calmed;
+	uint64_t pixels_verified;
+	uint64_t pixels_overwritten;
+	uint64_t zerocopy_sends;
+	uint64_t zerocopy_copied;
+
+	struct stats_stage_hists stage[STAGES];
+	struct hist latency[LATENCIES];	/* ns */
+
+	/* per-frame accumulators, folded into the histograms by stats_frame_end */
+	uint64_t frame_ns[STAGES];
+	uint64_t frame_pixels[STAGES];
+
+	struct stats *next;
+	bool registered;
+};
+
+extern __thread struct stats stats;
+extern bool pt_active;
+
+/* STATS_ADD adds n to a counter of the calling thread */
+#define STATS_ADD(field, n) \
+	__atomic_store_n(&stats.field, stats.field + (n), __ATOMIC_RELAXED)
+
+/* stats_now returns CLOCK_MONOTONIC_RAW in nanoseconds */
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t) ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+/*
+ * stats_register makes the calling thread's counters visible to stats_sum.
+ * Every thread that records stats should call it once before recording.
+ */
+void stats_register(void);
+
+/*
+ * stats_unregister folds the calling thread's counters into a global total
+ * before it exits. Redundant calls are safe.
+ */
+void stats_unregister(void);
+
+/* stats_sum adds up the counters of every registered thread into out. */
+void stats_sum(struct stats *out);
+
+/* hist_add records one value in h. h must belong to the calling thread. */
+void hist_add(struct hist *h, uint64_t value);
+
+/*
+ * hist_percentile returns an upper bound of the p-th percentile (0 < p <= 100)
+ * of the values in h, or 0 if h is empty.
+ */
+uint64_t hist_percentile(const struct hist *h, double p);
+
+/*
+ * hist_count_le returns how many values in h are known to be at most value,
+ * for exporting cumulative buckets.
+ */
+uint64_t hist_count_le(const struct hist *h, uint64_t value);
+
+/*
+ * stats_stage_add charges ns nanoseconds and a number of pixels to a stage of
+ * the current frame.
+ */
+static inline void stats_stage_add(enum stats_stage s, uint64_t ns, uint64_t pixels)
+{
+	stats.frame_ns[s] += ns;
+	stats.frame_pixels[s] += pixels;
+}
+
+/* stats_frame_end folds the current frame into the stage histograms. */
+void stats_frame_end(void);
+
+/*
+ * stats_json writes everything collected so far by all threads as a JSON
+ * object to f. elapsed_ns is the wall-clock length of the measurement.
+ */
+void stats_json(FILE *f, uint64_t elapsed_ns);
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
@@ -0,0 +1,185 @@
+#include <stdbool.h>	/* bool, true, false */
+#include <stdio.h>	/* flockfile, fopen, fprintf, perror */
+
+#include "error.h"	/* ERR_* */
+#include "stats.h"	/* stats_now, hist_add */
+
+#include "trace.h"
+
+/* Chrome trace events go on one track per thread of one process */
+#define TRACE_PID 1
+
+/* threads whose frames are followed at once */
+#define TRACE_THREADS 64
+
+static FILE *trace_file;
+static bool trace_first_event;
+static uint64_t trace_epoch;
+
+/* every thread follows frames of its own, in a slot of its own */
+static int num_slots;
+static __thread int slot = -1;
+
+static __thread struct {
+	uint64_t id;
+	uint64_t ready;
+	uint64_t grabbed;
+	uint64_t encoded;	/* when the last rect so far was encoded */
+	uint64_t sent;		/* when the last rect so far was sent */
+	int rects;
+	int merged;		/* later frames merged into this one */
+	bool open;
+} frame;
+
+/* ready of the open frame of each slot, or 0; read by the metrics thread */
+static uint64_t frame_since[TRACE_THREADS];
+
+static __thread struct {
+	int x1, x2, y1, y2;
+	uint64_t start;
+	uint64_t encoded;
+} rect;
+
+/* trace_event writes a complete ("X") event spanning [start, end] */
+static void trace_event(const char *name, uint64_t start, uint64_t end, const char *args)
+{
+	if (trace_file == NULL)
+		return;
+
+	flockfile(trace_file);
+	fprintf(trace_file, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {%s}}",
+			trace_first_event ? "" : ",",
+			name, TRACE_PID, slot + 1,
+			(start - trace_epoch) / 1e3,
+			(end - start) / 1e3,
+			args);
+	trace_first_event = false;
+	funlockfile(trace_file);
+}
+
+/* set_since publishes ready of the open frame of the calling thread, or 0 */
+static void set_since(uint64_t ready)
+{
+	if (slot < 0)
+		slot = __atomic_fetch_add(&num_slots, 1, __ATOMIC_RELAXED);
+	if (slot < TRACE_THREADS)
+		__atomic_store_n(&frame_since[slot], ready, __ATOMIC_RELAXED);
+}
+
+int trace_open(const char *path)
+{
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		perror("couldn't open trace file");
+		return ERR_BADARG;
+	}
+
+	fprintf(trace_file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	trace_first_event = true;
+	trace_epoch = stats_now();
+	return 0;
+}
+
+void trace_close(void)
+{
+	if (trace_file == NULL)
+		return;
+
+	fprintf(trace_file, "\n]}\n");
+	fclose(trace_file);
+	trace_file = NULL;
+}
+
+void trace_frame_begin(uint64_t ready)
+{
+	uint64_t now = stats_now();
+	ready = ready && ready <= now ? ready : now;
+	hist_add(&stats.latency[LATENCY_GRAB], now - ready);
+
+	/* latencies count from the oldest damage still being sent */
+	if (frame.open) {
+		frame.merged++;
+		STATS_ADD(frames_dropped, 1);
+		return;
+	}
+
+	frame.id++;
+	frame.grabbed = now;
+	frame.ready = ready;
+	frame.encoded = frame.grabbed;
+	frame.sent = frame.grabbed;
+	frame.rects = 0;
+	frame.merged = 0;
+	frame.open = true;
+	set_since(ready);
+}
+
+void trace_rect_begin(void)
+{
+	rect.start = stats_now();
+	rect.encoded = rect.start;
+}
+
+void trace_rect_encoded(int x1, int x2, int y1, int y2)
+{
+	rect.x1 = x1;
+	rect.x2 = x2;
+	rect.y1 = y1;
+	rect.y2 = y2;
+	rect.encoded = stats_now();
+	frame.encoded = rect.encoded;
+}
+
+void trace_rect_sent(void)
+{
+	/* damage left over from a frame that has ended belongs to none */
+	if (!frame.open)
+		return;
+
+	uint64_t now = stats_now();
+	frame.sent = now;
+	frame.rects++;
+
+	hist_add(&stats.latency[LATENCY_RECT], now - frame.ready);
+
+	if (trace_file) {
+		char args[128];
+		snprintf(args, sizeof(args), "\"frame\": %llu, \"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d",
+				(unsigned long long) frame.id,
+				rect.x1, rect.y1, rect.x2 - rect.x1, rect.y2 - rect.y1);
+		trace_event("encode", rect.start, rect.encoded, args);
+		trace_event("send", rect.encoded, now, args);
+	}
+}
+
+void trace_frame_end(void)
+{
+	frame.open = false;
+	set_since(0);
+
+	hist_add(&stats.latency[LATENCY_ENCODE], frame.encoded - frame.grabbed);
+	hist_add(&stats.latency[LATENCY_SEND], frame.sent - frame.encoded);
+	hist_add(&stats.latency[LATENCY_FRAME], frame.sent - frame.ready);
+
+	if (trace_file) {
+		char args[96];
+		snprintf(args, sizeof(args), "\"frame\": %llu, \"rects\": %d, \"merged\": %d",
+				(unsigned long long) frame.id, frame.rects, frame.merged);
+		trace_event("grab", frame.ready, frame.grabbed, args);
+		trace_event("frame", frame.ready, frame.sent, args);
+	}
+}
+
+uint64_t trace_frame_age(void)
+{
+	const int n = __atomic_load_n(&num_slots, __ATOMIC_RELAXED);
+	uint64_t oldest = 0;
+	for (int s = 0; s < n && s < TRACE_THREADS; s++) {
+		uint64_t since = __atomic_load_n(&frame_since[s], __ATOMIC_RELAXED);
+		if (since && (!oldest || since < oldest))
+			oldest = since;
+	}
+	return oldest ? stats_now() - oldest : 0;
+}
+
+/* vi: set ts=8 sts=8 sw=8 noet: */
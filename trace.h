@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>	/* uint64_t */
+
+/*
+ * The trace_* functions follow one frame at a time through the pipeline and
+ * record its end-to-end latencies in the stats.h histograms of the calling
+ * thread. Every thread follows frames of its own, on a track of its own in the
+ * Chrome trace. Timestamps come from stats_now.
+ */
+
+/*
+ * trace_open additionally writes every frame and rect as Chrome trace events
+ * (chrome://tracing, Perfetto) to path. Returns 0 on success.
+ */
+int trace_open(const char *path);
+
+/* trace_close finishes the Chrome trace file. Redundant calls are safe. */
+void trace_close(void);
+
+/*
+ * trace_frame_begin starts a frame whose pixels were just grabbed. ready is
+ * when the update was reported as ready. If the previous frame hasn't ended
+ * yet, the new one is merged into it, as their damage is sent together, and
+ * the previous one counts as dropped: it never showed up on its own.
+ */
+void trace_frame_begin(uint64_t ready);
+
+/*
+ * trace_rect_begin starts a rect of the current frame: one slice of its
+ * damage, sent in one go.
+ */
+void trace_rect_begin(void);
+
+/*
+ * trace_rect_encoded marks the current rect as completely encoded. The rect
+ * turned out to cover x1 <= x < x2, y1 <= y < y2.
+ */
+void trace_rect_encoded(int x1, int x2, int y1, int y2);
+
+/*
+ * trace_rect_sent marks the current rect as sent, meaning the socket has
+ * accepted the final byte of its last pixel. Outside of a frame, it does
+ * nothing.
+ */
+void trace_rect_sent(void);
+
+/* trace_frame_end finishes the current frame and records its latencies. */
+void trace_frame_end(void);
+
+/*
+ * trace_frame_age returns how many ns ago the oldest damage of the frames being
+ * sent by any thread was reported ready, or 0 between frames. Safe to call from
+ * any thread.
+ */
+uint64_t trace_frame_age(void);
+
+/* vi: set ts=8 sts=8 sw=8 noet: */